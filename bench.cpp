@@ -0,0 +1,272 @@
+#include "task_graph.h"
+#include "thread_pool.h"
+#include "task_algorithms.h"
+#include "task_stream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <new>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define MAX_TASKS 8192
+#define MAX_DEPENDENCIES 65536
+
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L
+#	define HAS_STD_SCAN 1
+#else
+#	define HAS_STD_SCAN 0
+#endif
+
+struct BenchPool
+{
+	void *mem;
+	ThreadPool pool;
+
+	BenchPool(unsigned num_threads, unsigned channels = 1)
+	{
+		mem = malloc(BIKESHED_SIZE(MAX_TASKS, MAX_DEPENDENCIES, channels));
+		assert(mem);
+		pool.shed = Bikeshed_Create(mem, MAX_TASKS, MAX_DEPENDENCIES, (uint8_t)channels, &pool);
+		pool.channels = channels;
+		pool.start(num_threads);
+	}
+
+	~BenchPool()
+	{
+		pool.shutdown();
+		free(mem);
+	}
+};
+
+template<typename F>
+double best_ms(unsigned reps, F &&f)
+{
+	double best = 1e30;
+	for (unsigned i = 0; i < reps; ++i) {
+		auto t0 = std::chrono::high_resolution_clock::now();
+		f();
+		auto t1 = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+		if (ms < best)
+			best = ms;
+	}
+	return best;
+}
+
+// Throughput is reported as memory traffic when bytes_per_element is known
+static void report(const char *name, unsigned count, double ms, double baseline_ms, unsigned bytes_per_element = 0)
+{
+	if (bytes_per_element)
+		printf("  %-22s %10.3f ms %8.2f GB/s %6.2fx\n", name, ms, (double)bytes_per_element * count / (ms * 1e6), baseline_ms / ms);
+	else
+		printf("  %-22s %10.3f ms %8.2f M/s  %6.2fx\n", name, ms, count / (ms * 1e3), baseline_ms / ms);
+}
+
+static void bench_scan(unsigned num_threads, unsigned max_count)
+{
+	printf("scan (%u threads, %s):\n", num_threads, kernels::isa_name());
+
+	BenchPool bp(num_threads);
+	const unsigned sizes[] = { 1u << 20, 1u << 24, 1u << 28, 1u << 30 };
+
+	for (unsigned count : sizes) {
+		if (count > max_count)
+			break;
+
+		uint32_t *in = new (std::nothrow) uint32_t[count];
+		uint32_t *out = new (std::nothrow) uint32_t[count];
+		if (!in || !out) {
+			printf(" %u elements: skipped, out of memory\n", count);
+			delete[] in;
+			delete[] out;
+			continue;
+		}
+
+		for (unsigned i = 0; i < count; ++i)
+			in[i] = i * 2654435761u;
+
+		unsigned reps = count > (1u << 26) ? 3 : 10;
+		printf(" %u elements:\n", count);
+
+		double base = best_ms(reps, [&]() {
+#if HAS_STD_SCAN
+			std::inclusive_scan(in, in + count, out);
+#else
+			std::partial_sum(in, in + count, out);
+#endif
+		});
+		report(HAS_STD_SCAN ? "std::inclusive_scan" : "std::partial_sum", count, base, base, 2 * sizeof(uint32_t));
+		uint32_t expect = out[count - 1];
+
+		double serial = best_ms(reps, [&]() {
+			memcpy(out, in, sizeof(uint32_t) * count);
+			kernels::prefix_sum(out, count, 0);
+		});
+		report("kernels::prefix_sum", count, serial, base, 2 * sizeof(uint32_t));
+
+		SliceSettings s = simd_settings<uint32_t>(num_threads * 4);
+		double parallel = best_ms(reps, [&]() {
+			parallel_inclusive_scan(bp.pool, in, out, count, s);
+		});
+		report("parallel_scan", count, parallel, base, 2 * sizeof(uint32_t));
+
+		if (out[count - 1] != expect)
+			printf("  MISMATCH %u != %u\n", out[count - 1], expect);
+
+		delete[] in;
+		delete[] out;
+	}
+}
+
+static void bench_sort(unsigned num_threads, unsigned max_count)
+{
+	printf("sort (%u threads):\n", num_threads);
+
+	BenchPool bp(num_threads);
+	const unsigned sizes[] = { 1u << 20, 1u << 24, 1u << 26 };
+
+	for (unsigned count : sizes) {
+		if (count > max_count)
+			break;
+
+		std::vector<uint32_t> input(count), work(count), expect;
+		for (unsigned i = 0; i < count; ++i)
+			input[i] = (i * 2654435761u) ^ (i >> 7);
+
+		unsigned reps = count > (1u << 22) ? 3 : 10;
+		printf(" %u elements:\n", count);
+
+		double base = best_ms(reps, [&]() {
+			work = input;
+			std::sort(work.begin(), work.end());
+		});
+		report("std::sort", count, base, base);
+		expect = work;
+
+		SliceSettings s;
+		s.max_chunks = num_threads * 2;
+		double parallel = best_ms(reps, [&]() {
+			work = input;
+			parallel_sort(bp.pool, work.begin(), work.end(), s);
+		});
+		report("parallel_sort", count, parallel, base);
+
+		if (work != expect)
+			printf("  MISMATCH\n");
+	}
+}
+
+// Stand-in for per-record parsing work
+static uint64_t mix(uint64_t v)
+{
+	for (unsigned i = 0; i < 64; ++i)
+		v = (v ^ (v >> 31)) * 0x9e3779b97f4a7c15ull;
+	return v;
+}
+
+static void bench_stream(unsigned num_threads, unsigned max_count)
+{
+	printf("stream (%u threads):\n", num_threads);
+
+	BenchPool bp(num_threads);
+	unsigned count = std::min(max_count, 1u << 22);
+	printf(" %u records:\n", count);
+
+	uint64_t expect = 0;
+	double base = best_ms(3, [&]() {
+		expect = 0;
+		for (unsigned i = 0; i < count; ++i)
+			expect += mix(i) & 0xff;
+	});
+	report("serial loop", count, base, base);
+
+	for (unsigned parallelism = 1; parallelism <= num_threads; parallelism *= 2) {
+		uint64_t total = 0;
+		double ms = best_ms(3, [&]() {
+			unsigned next = 0;
+			total = 0;
+			Stream stream(bp.pool);
+			auto &src = stream.source<uint64_t>([&](uint64_t &v) {
+				if (next == count)
+					return false;
+				v = next++;
+				return true;
+			});
+			auto &parsed = stream.stage<uint64_t, uint64_t>(src, [](uint64_t &in, uint64_t &out) {
+				out = mix(in) & 0xff;
+				return true;
+			}, parallelism, 1024);
+			stream.sink<uint64_t>(parsed, [&](uint64_t &v) { total += v; }, 1, 1024);
+			stream.run();
+			stream.wait();
+		});
+
+		char name[32];
+		snprintf(name, sizeof(name), "stream x%u", parallelism);
+		report(name, count, ms, base);
+		if (total != expect)
+			printf("  MISMATCH\n");
+	}
+}
+
+// Empty tasks, readied at once, so taking them off the ready heads is all
+// the work there is. Thread counts are fixed to compare scaling.
+static void bench_ready(unsigned max_count)
+{
+	printf("ready heads:\n");
+
+	struct Empty : TaskBase
+	{
+		virtual void operator()() override {}
+	};
+
+	unsigned count = std::min(max_count, (unsigned)MAX_TASKS);
+	std::vector<Empty> tasks(count);
+	printf(" %u tasks:\n", count);
+
+	const unsigned thread_counts[] = { 4, 16, 64 };
+	for (unsigned num_threads : thread_counts) {
+		double base = 0;
+		const unsigned channel_counts[] = { 1, std::min(num_threads, 16u) };
+		for (unsigned channels : channel_counts) {
+			BenchPool bp(num_threads, channels);
+			TaskGraph g(tasks);
+			PersistentTaskGraph runs(g, bp.pool);
+			double ms = best_ms(20, [&]() {
+				runs.submit();
+				runs.wait();
+			});
+			if (channels == 1)
+				base = ms;
+
+			char name[32];
+			snprintf(name, sizeof(name), "%u threads, %u head%s", num_threads, channels, channels == 1 ? "" : "s");
+			report(name, count, ms, base);
+		}
+	}
+}
+
+// bench [suite] [threads] [max elements]
+int main(int argc, char **argv)
+{
+	const char *suite = argc > 1 ? argv[1] : "all";
+	unsigned num_threads = argc > 2 ? (unsigned)atoi(argv[2]) : 4;
+	unsigned max_count = argc > 3 ? (unsigned)strtoul(argv[3], nullptr, 0) : 1u << 30;
+
+	bool all = strcmp(suite, "all") == 0;
+	if (all || strcmp(suite, "scan") == 0)
+		bench_scan(num_threads, max_count);
+	if (all || strcmp(suite, "sort") == 0)
+		bench_sort(num_threads, max_count);
+	if (all || strcmp(suite, "stream") == 0)
+		bench_stream(num_threads, max_count);
+	if (all || strcmp(suite, "ready") == 0)
+		bench_ready(max_count);
+
+	return 0;
+}
@@ -6,6 +6,7 @@ if not defined VCINSTALLDIR call "C:\Program Files\Microsoft Visual Studio\2022\
 pushd "%~dp0"
 if not exist build mkdir build
 pushd build
-call cl.exe /nologo /EHsc /MT /Zi %* ..\main.cpp ..\task_graph.cpp ..\stack_allocator.cpp
+call cl.exe /nologo /EHsc /MT /Zi %* ..\main.cpp ..\task_graph.cpp ..\thread_pool.cpp ..\slice_kernels.cpp ..\task_pipeline.cpp ..\stack_allocator.cpp ..\shared_pool.cpp
+call cl.exe /nologo /EHsc /MT /Zi /O2 /std:c++17 %* ..\bench.cpp ..\task_graph.cpp ..\thread_pool.cpp ..\slice_kernels.cpp ..\stack_allocator.cpp
 popd
 popd
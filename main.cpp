@@ -1,165 +1,72 @@
 #include "task_graph.h"
-
-#define BIKESHED_IMPLEMENTATION
-#include "bikeshed.h"
+#include "thread_pool.h"
+#include "static_task_graph.h"
+#include "slice_kernels.h"
+#include "task_pipeline.h"
+#include "task_stream.h"
+#include "task_cache.h"
+#include "shared_pool.h"
 
 #define WIN32_MEAN_AND_LEAN
 #include <windows.h>
 
-#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #define MAX_TASKS 1024
 #define MAX_DEPENDENCIES 1024
 
-#if defined(DEBUG) || defined(_DEBUG)
-#	define DEBUG_PRINTF(fmt, ...) \
-		do { \
-			fprintf(stderr, "[%lu] " fmt "\n", GetCurrentThreadId(), ## __VA_ARGS__); \
-			fflush(stderr); \
-		} while (0);
-#else
-#	define DEBUG_PRINTF(fmt, ...)
-#endif
-
-struct ThreadPool : public Bikeshed_ReadyCallback, public ThreadPoolInterface
-{
-	Bikeshed shed;
-	HANDLE semaphore;
-
-	std::vector<HANDLE> threads;
-	std::atomic<bool> quit{false};
-
-	ThreadPool() : shed(nullptr)
-	{
-		SignalReady = &bikeshed_signal_ready;
-		Bikeshed_SetAssert(bikeshed_assert);
-		semaphore = CreateSemaphoreW(NULL, 0, MAX_TASKS, NULL);
-		assert(semaphore);
-	}
-
-	~ThreadPool()
-	{
-		shutdown();
-		CloseHandle(semaphore);
-	}
-
-	void start(unsigned num_threads)
-	{
-		threads.resize(num_threads);
-		for (unsigned i = 0; i < num_threads; ++i) {
-			threads[i] = CreateThread(NULL, 0, worker_entry, this, 0, NULL);
-			assert(threads[i]);
-		}
-	}
-
-	void shutdown()
-	{
-		if (threads.empty())
-			return;
-
-		quit.store(true, std::memory_order_release);
-		ReleaseSemaphore(semaphore, (LONG)threads.size(), NULL);
-		WaitForMultipleObjects((DWORD)threads.size(), threads.data(), TRUE, INFINITE);
-
-		for (HANDLE h : threads)
-			CloseHandle(h);
+// Tasks of the shared memory demo; every process registers them alike
+struct SharedSquares { const uint32_t *data; unsigned count; uint64_t sum; };
+struct SharedTotal { const SharedSquares *parts; unsigned count; uint64_t sum; };
 
-		threads.clear();
-	}
-
-	unsigned num_threads() const
-	{
-		return (unsigned)threads.size();
-	}
-
-	static DWORD WINAPI worker_entry(LPVOID param)
-	{
-		ThreadPool *pool = (ThreadPool *)param;
-		DEBUG_PRINTF("thread start");
-		while (true) {
-			WaitForSingleObject(pool->semaphore, INFINITE);
-			DEBUG_PRINTF("thread woke");
-			if (pool->quit.load(std::memory_order_acquire))
-				break;
-			while (pool->do_work())
-				;
-		}
-		DEBUG_PRINTF("thread exit");
-		return 0;
-	}
-
-	static void bikeshed_assert(const char *expression, const char* file, int line)
-	{
-		fprintf(stderr, "Assertion failed: %s\n", expression);
-		fprintf(stderr, "At: %s:%d\n", file, line);
-		fflush(stderr);
-		assert(false);
-	}
-
-	static void bikeshed_signal_ready(struct Bikeshed_ReadyCallback* ready_callback, uint8_t channel, uint32_t ready_count)
-	{
-		DEBUG_PRINTF("bikeshed_signal_ready ready_count=%u", ready_count);
-		ThreadPool *self = (ThreadPool *)ready_callback;
-		ReleaseSemaphore(self->semaphore, ready_count, NULL);
-	}
-
-	static Bikeshed_TaskResult bikeshed_trampoline(Bikeshed shed, Bikeshed_TaskID task_id, uint8_t channel, void *context)
-	{
-		DEBUG_PRINTF("bikeshed_trampoline");
-		(*static_cast<TaskBase *>(context))();
-		return BIKESHED_TASK_RESULT_COMPLETE;
-	}
-
-	virtual void add_tasks(TaskBase **tasks, unsigned num_tasks, uint32_t *out_task_ids) override
-	{
-		std::vector<BikeShed_TaskFunc> funcs;
-		funcs.reserve(num_tasks);
-		for (unsigned i = 0; i < num_tasks; ++i)
-			funcs.push_back(bikeshed_trampoline);
-
-		int ok = Bikeshed_CreateTasks(shed, num_tasks, funcs.data(), reinterpret_cast<void **>(tasks), out_task_ids);
-		assert(ok);
-	}
-
-	virtual void add_dependencies(uint32_t *tasks, unsigned num_tasks, uint32_t *dependencies, unsigned num_dependencies) override
-	{
-		int ok = Bikeshed_AddDependencies(shed, num_tasks, tasks, num_dependencies, dependencies);
-		assert(ok);
-	}
+void sum_squares(void *arg) {
+	SharedSquares &s = *(SharedSquares *)arg;
+	s.sum = 0;
+	for (unsigned i = 0; i < s.count; ++i)
+		s.sum += (uint64_t)s.data[i] * s.data[i];
+}
 
-	virtual void ready_tasks(uint32_t *tasks, unsigned num_tasks) override
-	{
-		Bikeshed_ReadyTasks(shed, num_tasks, tasks);
-	}
+void sum_parts(void *arg) {
+	SharedTotal &t = *(SharedTotal *)arg;
+	t.sum = 0;
+	for (unsigned i = 0; i < t.count; ++i)
+		t.sum += t.parts[i].sum;
+}
 
-	virtual bool do_work() override
-	{
-		return Bikeshed_ExecuteOne(shed, 0) == 1;
-	}
+void register_shared_functions(SharedPool &pool) {
+	pool.register_function(0, sum_squares);
+	pool.register_function(1, sum_parts);
+}
 
-	virtual void yield() override
-	{
-		YieldProcessor();
-	}
-};
+int shared_worker(const char *name) {
+	SharedPool pool;
+	register_shared_functions(pool);
+	if (!pool.attach(name))
+		return 1;
+	pool.serve();
+	return 0;
+}
 
 int safe_main() {
 	const unsigned bytes = BIKESHED_SIZE(MAX_TASKS, MAX_DEPENDENCIES, 1);
 	void *mem = malloc(bytes);
 	assert(mem);
 
-	DEBUG_PRINTF("Bikeshed: %u bytes", bytes);
-
 	ThreadPool pool;
 	pool.shed = Bikeshed_Create(mem, MAX_TASKS, MAX_DEPENDENCIES, 1, &pool);
 	pool.start(4);
 
-	DEBUG_PRINTF("ThreadPool: %u threads", (unsigned)pool.threads.size());
-
 	{
 		printf("task function objects:\n");
 
@@ -228,6 +135,14 @@ int safe_main() {
 		g.wait(pool);
 
 		printf("  result: %d\n", e.value);
+
+		printf("static task graph:\n");
+
+		StaticTaskGraph<struct e, struct d, struct c, struct b, struct a> sg(e, d, c, b, a);
+		sg.submit(pool);
+		sg.wait(pool);
+
+		printf("  result: %d\n", e.value);
 	}
 
 	{
@@ -247,6 +162,484 @@ int safe_main() {
 		printf("  result: %d\n", ve);
 	}
 
+	{
+		printf("typed outputs:\n");
+
+		struct load : Task<std::vector<int>()>
+		{
+			virtual std::vector<int> run() override { return std::vector<int>(1 << 16, 1); }
+		};
+
+		// Sole consumer, so it takes the buffer over instead of copying it
+		struct scale : Task<std::vector<int>(std::vector<int>)>
+		{
+			using Task::Task;
+			virtual std::vector<int> run(std::shared_ptr<std::vector<int>> in) override {
+				std::vector<int> v = take_input(in);
+				for (int &x : v)
+					x *= 3;
+				return v;
+			}
+		};
+
+		struct total : Task<int(std::vector<int>)>
+		{
+			using Task::Task;
+			virtual int run(std::shared_ptr<std::vector<int>> in) override {
+				int sum = 0;
+				for (int x : *in)
+					sum += x;
+				return sum;
+			}
+		};
+
+		load l;
+		scale s(l);
+		total t(s);
+		TaskGraph g(l, s, t);
+		g.submit(pool);
+		g.wait(pool);
+
+		// Both buffers were freed once their consumer had run
+		printf("  buffers held: %d\n", (l.value ? 1 : 0) + (s.value ? 1 : 0));
+		printf("  result: %d\n", t.result());
+	}
+
+	{
+		printf("task chains:\n");
+
+		int v = 0;
+		auto load = make_task_fn([&]() { v = 1; printf("  load=%d\n", v); });
+		auto decode = make_task_fn([&]() { v *= 10; printf("  decode=%d\n", v); }, load);
+		auto process = make_task_fn([&]() { v += 5; printf("  process=%d\n", v); }, decode);
+
+		TaskGraph g(load, decode, process);
+		g.submit(pool);
+		g.wait(pool);
+
+		printf("  fused: %u chain(s), %u tasks\n", (unsigned)g.chains.size(), (unsigned)g.chain_links.size());
+		printf("  result: %d\n", v);
+	}
+
+	{
+		printf("inline tasks:\n");
+
+		// The sums are too cheap to be worth a trip through the scheduler,
+		// so the worker that fills the table runs them, then the total
+		int table[64];
+		int low = 0, high = 0, total = 0;
+		auto fill = make_task_fn([&]() { for (int i = 0; i < 64; ++i) table[i] = i; });
+		auto sum_low = make_task_fn([&]() { for (int i = 0; i < 32; ++i) low += table[i]; }, fill);
+		auto sum_high = make_task_fn([&]() { for (int i = 32; i < 64; ++i) high += table[i]; }, fill);
+		auto sum = make_task_fn([&]() { total = low + high; }, sum_low, sum_high);
+		sum_low.cost = sum_high.cost = sum.cost = 50;
+
+		TaskGraph g(fill, sum_low, sum_high, sum);
+		g.submit(pool);
+		g.wait(pool);
+
+		printf("  inlined: %u of 4 tasks\n", (unsigned)g.inline_tasks.size());
+		printf("  result: %d\n", total);
+	}
+
+	{
+		printf("memory budget:\n");
+
+		struct render : Task<>
+		{
+			std::vector<char> tile;
+			virtual void operator()() override { tile.assign(1 << 20, 1); }
+		};
+
+		// Frees the tile it reads, along with the budget it took
+		struct reduce : Task<render>
+		{
+			using Task::Task;
+			int sum = 0;
+			virtual void operator()() override {
+				std::vector<char> &tile = std::get<0>(in).tile;
+				for (char c : tile)
+					sum += c;
+				std::vector<char>().swap(tile);
+			}
+		};
+
+		// Eight 1 MB tiles, but never more than two alive at once
+		MemoryBudget budget(2 << 20);
+		std::vector<render> tiles(8);
+		std::deque<reduce> sums;
+		TaskGraph g(tiles);
+		for (render &t : tiles) {
+			t.memory = 1 << 20;
+			sums.emplace_back(t);
+			g.add(sums.back());
+		}
+		g.budget = &budget;
+		g.submit(pool);
+		g.wait(pool);
+
+		int total = 0;
+		for (reduce &r : sums)
+			total += r.sum;
+		printf("  peak: %u of %u MB\n", (unsigned)(budget.peak >> 20), (unsigned)(budget.limit >> 20));
+		printf("  result: %d\n", total);
+	}
+
+	{
+		printf("task errors:\n");
+
+		int v = 0;
+		auto parse = make_task_fn([&]() { printf("  parse\n"); throw std::runtime_error("bad input"); });
+		auto build = make_task_fn([&]() { v = 1; printf("  build\n"); }, parse);
+		auto other = make_task_fn([&]() { printf("  other\n"); });
+
+		// build is skipped; other still runs
+		TaskGraph g(parse, build, other);
+		g.submit(pool);
+		try {
+			g.wait(pool);
+		} catch (const std::exception &e) {
+			printf("  caught: %s\n", e.what());
+		}
+
+		printf("  result: %d\n", v);
+	}
+
+	{
+		printf("bounded waits:\n");
+
+		std::vector<uint32_t> data(16);
+		auto tasks = slice<uint32_t>(data.size(), data.data(), [](Slice<uint32_t, uint32_t>) {
+			Sleep(20);
+		}, { 16, 1, 1 });
+
+		TaskGraph g(tasks);
+		g.submit(pool);
+
+		// Gives up early, then comes back for the result
+		if (g.wait_for(pool, std::chrono::milliseconds(5)) == WaitStatus::Timeout)
+			printf("  timed out\n");
+		g.wait(pool);
+
+		printf("  result: %s\n", g.poll() == WaitStatus::Ready ? "ready" : "running");
+	}
+
+	{
+		printf("persistent graphs:\n");
+
+		int frame = 0, physics = 0, render = 0;
+		auto update = make_task_fn([&]() { ++frame; });
+		auto simulate = make_task_fn([&]() { physics += frame; }, update);
+		auto draw = make_task_fn([&]() { render += frame; }, update);
+
+		// The pool tasks are created once and reused by every frame
+		TaskGraph g(update, simulate, draw);
+		PersistentTaskGraph frames(g, pool);
+		for (int i = 0; i < 100; ++i) {
+			frames.submit();
+			frames.wait();
+		}
+
+		printf("  result: %d frames, physics %d, render %d\n", frame, physics, render);
+	}
+
+	{
+		printf("incremental graphs:\n");
+
+		int mesh = 0, texture = 0, material = 0;
+		auto load_mesh = make_task_fn([&]() { ++mesh; printf("  load mesh %d\n", mesh); });
+		auto load_texture = make_task_fn([&]() { ++texture; printf("  load texture %d\n", texture); });
+		auto build_material = make_task_fn([&]() {
+			material = mesh * 10 + texture;
+			printf("  build material %d\n", material);
+		}, load_mesh, load_texture);
+
+		TaskGraph g(load_mesh, load_texture, build_material);
+		g.incremental = true;
+		g.submit(pool);
+		g.wait(pool);
+
+		// Only the texture changed; the mesh keeps its previous result
+		g.invalidate(load_texture);
+		g.submit(pool);
+		g.wait(pool);
+
+		printf("  result: %d\n", material);
+	}
+
+	{
+		printf("cached tasks:\n");
+
+		struct LoadShader : Task<>
+		{
+			int source = 0;
+			virtual void operator()() override {}
+		};
+
+		struct CompileShader : CachedTask<int, LoadShader>
+		{
+			using CachedTask::CachedTask;
+			virtual void hash_inputs(TaskHash &h) override { h.add(input<0>().source); }
+			virtual void compute(int &out) override
+			{
+				out = input<0>().source * 1000;
+				printf("  compiled %d\n", input<0>().source);
+			}
+		};
+
+		TaskCache<int> cache(16);
+		LoadShader load;
+		CompileShader compile(cache, load);
+		TaskGraph g(load, compile);
+
+		const int sources[] = { 1, 2, 1 };
+		for (int source : sources) {
+			load.source = source;
+			g.submit(pool);
+			g.wait(pool);
+			printf("  shader %d: %d%s\n", source, compile.output, compile.cache_hit ? " (cached)" : "");
+		}
+	}
+
+	{
+		printf("batched graphs:\n");
+
+		int v[3] = {};
+		auto a = make_task_fn([&]() { v[0] = 1; });
+		auto b = make_task_fn([&]() { v[1] = 2; });
+		auto c = make_task_fn([&]() { v[2] = 3; });
+		auto d = make_task_fn([&]() { v[2] *= v[2]; }, c);
+
+		TaskGraph ga(a), gb(b), gc(c, d);
+		TaskGraphBatch batch(BatchFence::Shared);
+		batch.add(ga);
+		batch.add(gb);
+		batch.add(gc);
+		batch.submit(pool);
+		batch.wait(pool);
+
+		printf("  result: %d %d %d\n", v[0], v[1], v[2]);
+	}
+
+	{
+		printf("chained graphs:\n");
+
+		int frame[2] = {};
+		auto prep0 = make_task_fn([&]() { frame[0] = 10; printf("  prep 0\n"); });
+		auto render0 = make_task_fn([&]() { printf("  render 0\n"); }, prep0);
+		TaskGraph g0(prep0, render0);
+
+		// Frame 1 starts from frame 0's prep without waiting for its render
+		auto sim1 = make_task_fn([&]() { frame[1] = frame[0] + 1; printf("  sim 1\n"); }, g0.fence_after(prep0));
+		TaskGraph g1(sim1);
+
+		g1.submit(pool);
+		g0.submit(pool);
+		g1.wait(pool);
+		g0.wait(pool);
+
+		printf("  result: %d %d\n", frame[0], frame[1]);
+	}
+
+	{
+		printf("pipelined frames:\n");
+
+		typedef std::function<void()> Fn;
+		struct Frame : PipelineFrame
+		{
+			TaskFn<Fn> simulate;
+			TaskFn<Fn, TaskFn<Fn>> render;
+
+			Frame(Fn s, Fn r) : simulate(std::move(s)), render(std::move(r), simulate)
+			{
+				graph.add(simulate);
+				graph.add(render);
+				stage(simulate);
+				stage(render);
+			}
+		};
+
+		// Simulation carries state from frame to frame; render reads this frame's
+		int state = 0;
+		int rendered[8] = {};
+		FramePipeline pipeline(pool, 3, [&](uint64_t index) {
+			auto value = std::make_shared<int>(0);
+			return std::unique_ptr<PipelineFrame>(new Frame(
+				[&state, value]() { *value = state = state * 2 + 1; },
+				[&rendered, value, index]() { rendered[index] = *value; }));
+		});
+		pipeline.run(8);
+		pipeline.drain();
+
+		printf("  result:");
+		for (int v : rendered)
+			printf(" %d", v);
+		printf("\n");
+	}
+
+	{
+		printf("streaming stages:\n");
+
+		// Parse "key=value" records, drop the ones without a value and total the rest
+		const char *log[] = { "a=1", "b=20", "c", "d=300", "e=4000" };
+		unsigned next = 0;
+		uint64_t total = 0;
+		unsigned records = 0;
+
+		struct Record { char key; int value; };
+		Stream stream(pool);
+		auto &lines = stream.source<const char *>([&](const char *&line) {
+			if (next == sizeof(log) / sizeof(log[0]))
+				return false;
+			line = log[next++];
+			return true;
+		});
+		auto &parsed = stream.stage<const char *, Record>(lines, [](const char *&line, Record &r) {
+			const char *eq = strchr(line, '=');
+			if (!eq)
+				return false;
+			r.key = line[0];
+			r.value = atoi(eq + 1);
+			return true;
+		}, 2, 4);
+		stream.sink<Record>(parsed, [&](Record &r) { total += r.value; ++records; });
+		stream.run();
+		stream.wait();
+
+		printf("  result: %u records, total %llu\n", records, (unsigned long long)total);
+	}
+
+	{
+		printf("shared workers:\n");
+
+		// Two subsystems share two threads; audio gets three times the share
+		// of streaming and streaming never more than one thread
+		WorkerSet workers;
+		workers.start(2);
+
+		void *audio_mem = malloc(bytes);
+		void *streaming_mem = malloc(bytes);
+		ThreadPool audio, streaming;
+		audio.shed = Bikeshed_Create(audio_mem, MAX_TASKS, MAX_DEPENDENCIES, 1, &audio);
+		streaming.shed = Bikeshed_Create(streaming_mem, MAX_TASKS, MAX_DEPENDENCIES, 1, &streaming);
+		audio.join(workers, 3);
+		streaming.join(workers, 1, 1);
+
+		int mixed = 0, loaded = 0;
+		auto mix = make_task_fn([&]() { mixed = 48000; });
+		auto load = make_task_fn([&]() { loaded = 64; });
+		TaskGraph a(mix), s(load);
+		a.submit(audio);
+		s.submit(streaming);
+		a.wait(audio);
+		s.wait(streaming);
+
+		audio.shutdown();
+		streaming.shutdown();
+		free(audio_mem);
+		free(streaming_mem);
+
+		printf("  result: mixed %d, loaded %d\n", mixed, loaded);
+	}
+
+	{
+		printf("shared memory workers:\n");
+
+		// Two worker processes run the tasks alongside this one; the data
+		// and the partial sums live in the segment. Should the workers fail
+		// to attach, wait() runs everything here
+		char name[64];
+		snprintf(name, sizeof(name), "Local\\task_graph_demo_%lu", GetCurrentProcessId());
+		SharedPool shared;
+		register_shared_functions(shared);
+		if (shared.create(name, 1 << 20, MAX_TASKS, MAX_DEPENDENCIES)) {
+			std::string args = std::string("--shared-worker ") + name;
+			shared.launch(2, args.c_str());
+
+			const unsigned count = 1 << 16, num_parts = 8;
+			uint32_t *data = (uint32_t *)shared.allocate(count * sizeof(uint32_t));
+			for (unsigned i = 0; i < count; ++i)
+				data[i] = i;
+
+			SharedSquares *parts = (SharedSquares *)shared.allocate(num_parts * sizeof(SharedSquares));
+			SharedTotal *total = (SharedTotal *)shared.allocate(sizeof(SharedTotal));
+			*total = { parts, num_parts, 0 };
+
+			uint32_t ids[num_parts];
+			for (unsigned i = 0; i < num_parts; ++i) {
+				parts[i] = { data + i * (count / num_parts), count / num_parts, 0 };
+				ids[i] = shared.add_task(0, &parts[i]);
+			}
+			uint32_t reduce = shared.add_task(1, total);
+			shared.add_dependencies(reduce, ids, num_parts);
+			shared.ready_tasks(ids, num_parts);
+			shared.wait();
+
+			printf("  result: %llu\n", (unsigned long long)total->sum);
+			shared.close();
+		}
+	}
+
+	{
+		printf("task affinity:\n");
+
+		// One channel per worker; readied dependents stay with the worker
+		// that produced their input, and the audio task stays on worker 1
+		const unsigned local_bytes = BIKESHED_SIZE(MAX_TASKS, MAX_DEPENDENCIES, 2);
+		void *local_mem = malloc(local_bytes);
+		ThreadPool local;
+		local.shed = Bikeshed_Create(local_mem, MAX_TASKS, MAX_DEPENDENCIES, 2, &local);
+		local.channels = 2;
+		local.locality = true;
+		local.start(2);
+
+		std::vector<int> samples;
+		int peak = 0, mixed = 0;
+		auto decode = make_task_fn([&]() { samples.assign(256, 3); });
+		auto measure = make_task_fn([&]() { for (int v : samples) peak = v > peak ? v : peak; }, decode);
+		auto mix = make_task_fn([&]() { for (int v : samples) mixed += v; }, decode);
+		mix.affinity = 1;
+
+		TaskGraph g(decode, measure, mix);
+		g.submit(local);
+		g.wait(local);
+
+		local.shutdown();
+		free(local_mem);
+
+		printf("  result: peak %d, mixed %d\n", peak, mixed);
+	}
+
+	{
+		printf("elastic workers:\n");
+
+		// No threads while idle, up to four during a burst
+		void *burst_mem = malloc(bytes);
+		ThreadPool burst;
+		burst.shed = Bikeshed_Create(burst_mem, MAX_TASKS, MAX_DEPENDENCIES, 1, &burst);
+		burst.start_elastic(0, 4, 20);
+
+		std::vector<uint32_t> data(1 << 16, 1);
+		auto tasks = slice<uint32_t>(data.size(), data.data(), [](Slice<uint32_t, uint32_t> s) {
+			s.result = kernels::sum(s.data, s.count);
+		}, { 64, 1, 1 });
+
+		TaskGraph g(tasks);
+		g.submit(burst);
+		g.wait(burst);
+
+		uint32_t result = 0;
+		for (auto &t : tasks)
+			result += t.result;
+
+		Sleep(100);
+		printf("  idle workers: %u\n", burst.concurrency());
+		burst.shutdown();
+		free(burst_mem);
+
+		printf("  result: %u\n", result);
+	}
+
 	{
 		printf("task slicing:\n");
 
@@ -256,9 +649,7 @@ int safe_main() {
 		};
 
 		auto tasks = slice<uint32_t>(data.size(), data.data(), [](Slice<uint32_t, uint32_t> s) {
-			uint32_t result = 0;
-			for (unsigned i = 0; i < s.count; ++i)
-				result += s.data[i];
+			uint32_t result = kernels::sum(s.data, s.count);
 			s.result = result;
 			printf("  summed: %u %u\n", s.count, result);
 		}, { pool.num_threads(), 1, 1 });
@@ -274,12 +665,68 @@ int safe_main() {
 		printf("  result: %u\n", result);
 	}
 
+	{
+		printf("cancellation:\n");
+
+		std::vector<uint32_t> data(1 << 16);
+		for (unsigned i = 0; i < data.size(); ++i)
+			data[i] = i;
+
+		// The first chunk to find the value stops the others
+		CancellationToken found;
+		std::atomic<uint32_t> position{0xffffffffu};
+		auto tasks = slice<uint32_t>(data.size(), data.data(), [&](Slice<uint32_t, uint32_t> s) {
+			for (uint32_t i = 0; i < s.count && !s.cancelled(); ++i) {
+				if (s.data[i] == 4242) {
+					position = (uint32_t)(s.data + i - data.data());
+					found.cancel();
+				}
+			}
+		}, { pool.num_threads() * 4, 1, 1 });
+
+		TaskGraph g(tasks);
+		g.token = &found;
+		g.submit(pool);
+		g.wait(pool);
+
+		printf("  result: found at %u\n", position.load());
+	}
+
+	{
+		printf("vectorized slicing (%s):\n", kernels::isa_name());
+
+		std::vector<uint32_t> data(1 << 20);
+		for (unsigned i = 0; i < data.size(); ++i)
+			data[i] = (i * 2654435761u) >> 8;
+
+		struct MinMax { uint32_t lo, hi; };
+		auto tasks = slice<MinMax>(data.size(), data.data(), [](Slice<uint32_t, MinMax> s) {
+			s.result.lo = kernels::minimum(s.data, s.count);
+			s.result.hi = kernels::maximum(s.data, s.count);
+		}, simd_settings<uint32_t>(pool.num_threads() * 4));
+
+		TaskGraph g(tasks);
+		g.submit(pool);
+		g.wait(pool);
+
+		MinMax result = { 0xffffffffu, 0 };
+		for (auto &t : tasks) {
+			result.lo = t.result.lo < result.lo ? t.result.lo : result.lo;
+			result.hi = t.result.hi > result.hi ? t.result.hi : result.hi;
+		}
+
+		printf("  chunks: %u\n", (unsigned)tasks.size());
+		printf("  result: min=%u max=%u\n", result.lo, result.hi);
+	}
+
 	free(mem);
 	return 0;
 }
 
-int main() {
+int main(int argc, char **argv) {
 	__try {
+		if (argc == 3 && strcmp(argv[1], "--shared-worker") == 0)
+			return shared_worker(argv[2]);
 		return safe_main();
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER) {
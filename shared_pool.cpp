@@ -0,0 +1,423 @@
+#include "shared_pool.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <atomic>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <assert.h>
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "shared pool counters must be lock-free to work across processes");
+
+struct SharedPool::Header
+{
+	// First, so that the shed's callback pointer is the header's address
+	Bikeshed_ReadyCallback callback;
+
+	std::atomic<uint32_t> magic;
+	uint64_t base;
+	uint64_t size;
+	uint64_t heap_begin;
+	std::atomic<uint64_t> heap_top;
+
+	std::atomic<uint32_t> outstanding;
+	std::atomic<uint32_t> quit;
+	std::atomic<uint32_t> failed;
+	char message[160];
+
+	struct Worker
+	{
+		std::atomic<uint32_t> pid;
+		std::atomic<uint32_t> task; // running right now, 0 if none
+	};
+	Worker workers[MAX_WORKERS];
+};
+
+namespace
+{
+
+enum : uint32_t { MAGIC = 0x53485450 };
+enum : uint64_t { SHED_OFFSET = (sizeof(SharedPool::Header) + 63) & ~(uint64_t)63 };
+
+struct SharedTask
+{
+	uint32_t function;
+	void *arg;
+};
+
+// Pools mapped by this process, so the shed's callbacks, which only get
+// pointers into the segment, find the process-local state
+std::atomic<SharedPool *> local_pools[4];
+
+SharedPool *local_pool(const void *header)
+{
+	for (auto &p : local_pools) {
+		SharedPool *pool = p.load(std::memory_order_acquire);
+		if (pool && pool->header == header)
+			return pool;
+	}
+	return nullptr;
+}
+
+bool enroll(SharedPool *pool)
+{
+	for (auto &p : local_pools) {
+		SharedPool *expected = nullptr;
+		if (p.compare_exchange_strong(expected, pool))
+			return true;
+	}
+	return false;
+}
+
+void withdraw(SharedPool *pool)
+{
+	for (auto &p : local_pools) {
+		SharedPool *expected = pool;
+		p.compare_exchange_strong(expected, nullptr);
+	}
+}
+
+std::string ready_name(const char *name)
+{
+	return std::string(name) + ".ready";
+}
+
+// The first failure of a run wins; its message is written before the task
+// that failed is counted out, so wait() always finds it
+void fail(SharedPool::Header &h, const char *fmt, ...)
+{
+	uint32_t expected = 0;
+	if (!h.failed.compare_exchange_strong(expected, 1))
+		return;
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(h.message, sizeof(h.message), fmt, args);
+	va_end(args);
+}
+
+void signal_ready(Bikeshed_ReadyCallback *ready_callback, uint8_t, uint32_t ready_count)
+{
+	SharedPool *pool = local_pool(ready_callback);
+	assert(pool);
+	ReleaseSemaphore(pool->semaphore, (LONG)ready_count, NULL);
+}
+
+Bikeshed_TaskResult shared_task_entry(Bikeshed shed, Bikeshed_TaskID task_id, uint8_t, void *context)
+{
+	SharedPool *pool = local_pool((const char *)shed - SHED_OFFSET);
+	assert(pool);
+	SharedPool::Header &h = *pool->header;
+	const SharedTask &t = *static_cast<const SharedTask *>(context);
+
+	if (pool->slot != ~0u)
+		h.workers[pool->slot].task.store(task_id);
+
+	// Once a run has failed the rest of it only drains
+	if (!h.failed.load()) {
+		SharedTaskFunc f = t.function < SharedPool::MAX_FUNCTIONS ? pool->functions[t.function] : nullptr;
+		if (!f) {
+			fail(h, "shared task function %u is not registered in process %lu", t.function, (unsigned long)GetCurrentProcessId());
+		} else {
+			try {
+				f(t.arg);
+			} catch (const std::exception &e) {
+				fail(h, "%s", e.what());
+			} catch (...) {
+				fail(h, "shared task function %u threw", t.function);
+			}
+		}
+	}
+
+	if (pool->slot != ~0u)
+		h.workers[pool->slot].task.store(0);
+	h.outstanding.fetch_sub(1);
+	return BIKESHED_TASK_RESULT_COMPLETE;
+}
+
+} // anonymous
+
+SharedPool::SharedPool()
+	: header(nullptr), shed(nullptr), mapping(nullptr), semaphore(nullptr), owner(false), slot(~0u), functions(), watched(), watched_pid()
+{
+}
+
+SharedPool::~SharedPool()
+{
+	close();
+}
+
+void SharedPool::register_function(uint32_t id, SharedTaskFunc f)
+{
+	assert(!header && "register functions before creating or attaching");
+	assert(id < MAX_FUNCTIONS);
+	functions[id] = f;
+}
+
+bool SharedPool::create(const char *name, std::size_t bytes, uint32_t max_tasks, uint32_t max_dependencies)
+{
+	assert(!header);
+	uint64_t heap_begin = SHED_OFFSET + ((BIKESHED_SIZE(max_tasks, max_dependencies, 1) + 63) & ~(uint64_t)63);
+	uint64_t size = heap_begin + bytes;
+
+	mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, name);
+	if (!mapping)
+		return false;
+	if (GetLastError() == ERROR_ALREADY_EXISTS) {
+		CloseHandle(mapping);
+		mapping = nullptr;
+		return false;
+	}
+	void *view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size);
+	semaphore = CreateSemaphoreA(NULL, 0, 0x7fffffff, ready_name(name).c_str());
+	if (!view || !semaphore || !enroll(this)) {
+		if (view)
+			UnmapViewOfFile(view);
+		if (semaphore)
+			CloseHandle(semaphore);
+		CloseHandle(mapping);
+		mapping = semaphore = nullptr;
+		return false;
+	}
+
+	header = new (view) Header();
+	header->callback.SignalReady = &signal_ready;
+	header->base = (uint64_t)(uintptr_t)view;
+	header->size = size;
+	header->heap_begin = heap_begin;
+	header->heap_top.store(heap_begin);
+	shed = Bikeshed_Create((char *)view + SHED_OFFSET, max_tasks, max_dependencies, 1, &header->callback);
+	owner = true;
+
+	// The shed is laid out by the implementation compiled in thread_pool.cpp;
+	// it must end where BIKESHED_SIZE said here, or allocations overwrite it
+	const char *shed_end = (const char *)(shed->m_Dependencies + max_dependencies);
+	assert(shed_end <= (const char *)view + heap_begin);
+	if (shed_end > (const char *)view + heap_begin) {
+		close();
+		return false;
+	}
+
+	// Last, so a process attaching early sees an unfinished segment as foreign
+	header->magic.store(MAGIC, std::memory_order_release);
+	return true;
+}
+
+bool SharedPool::attach(const char *name)
+{
+	assert(!header);
+	mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+	if (!mapping)
+		return false;
+
+	// Look at the header wherever it lands first to learn where it belongs.
+	// Our signal_ready only has the creator's address in the same image
+	uint64_t base = 0, size = 0;
+	if (void *probe = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Header))) {
+		const Header *h = (const Header *)probe;
+		if (h->magic.load(std::memory_order_acquire) == MAGIC && h->callback.SignalReady == &signal_ready) {
+			base = h->base;
+			size = h->size;
+		}
+		UnmapViewOfFile(probe);
+	}
+
+	void *view = base ? MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size, (void *)(uintptr_t)base) : nullptr;
+	semaphore = view ? OpenSemaphoreA(SEMAPHORE_ALL_ACCESS, FALSE, ready_name(name).c_str()) : nullptr;
+	if (!semaphore || !enroll(this)) {
+		if (view)
+			UnmapViewOfFile(view);
+		if (semaphore)
+			CloseHandle(semaphore);
+		CloseHandle(mapping);
+		mapping = semaphore = nullptr;
+		return false;
+	}
+
+	header = (Header *)view;
+	shed = (Bikeshed)((char *)view + SHED_OFFSET);
+	uint32_t pid = (uint32_t)GetCurrentProcessId();
+	for (unsigned i = 0; i < MAX_WORKERS && slot == ~0u; ++i) {
+		uint32_t expected = 0;
+		if (header->workers[i].pid.compare_exchange_strong(expected, pid))
+			slot = i;
+	}
+	if (slot == ~0u) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool SharedPool::launch(unsigned num_processes, const char *args)
+{
+	assert(owner);
+	char path[MAX_PATH];
+	DWORD n = GetModuleFileNameA(NULL, path, MAX_PATH);
+	if (n == 0 || n == MAX_PATH)
+		return false;
+
+	for (unsigned i = 0; i < num_processes; ++i) {
+		std::string command = std::string("\"") + path + "\" " + args;
+		STARTUPINFOA startup = {};
+		startup.cb = sizeof(startup);
+		PROCESS_INFORMATION process;
+		if (!CreateProcessA(path, &command[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process))
+			return false;
+		CloseHandle(process.hThread);
+		launched.push_back(process.hProcess);
+	}
+	return true;
+}
+
+void SharedPool::close()
+{
+	if (!header)
+		return;
+
+	if (owner) {
+		header->quit.store(1);
+		ReleaseSemaphore(semaphore, MAX_WORKERS, NULL);
+		for (void *p : launched) {
+			WaitForSingleObject(p, INFINITE);
+			CloseHandle(p);
+		}
+		launched.clear();
+	} else if (slot != ~0u) {
+		header->workers[slot].pid.store(0);
+		slot = ~0u;
+	}
+	for (unsigned i = 0; i < MAX_WORKERS; ++i) {
+		if (watched[i])
+			CloseHandle(watched[i]);
+		watched[i] = nullptr;
+		watched_pid[i] = 0;
+	}
+
+	withdraw(this);
+	UnmapViewOfFile(header);
+	CloseHandle(mapping);
+	CloseHandle(semaphore);
+	header = nullptr;
+	shed = nullptr;
+	mapping = semaphore = nullptr;
+	owner = false;
+}
+
+void *SharedPool::allocate(std::size_t bytes, std::size_t alignment)
+{
+	assert(alignment && (alignment & (alignment - 1)) == 0);
+	uint64_t top = header->heap_top.load();
+	for (;;) {
+		uint64_t begin = (top + alignment - 1) & ~(uint64_t)(alignment - 1);
+		if (begin + bytes > header->size)
+			return nullptr;
+		if (header->heap_top.compare_exchange_weak(top, begin + bytes))
+			return (char *)header + begin;
+	}
+}
+
+uint32_t SharedPool::add_task(uint32_t function, void *arg)
+{
+	SharedTask *t = (SharedTask *)allocate(sizeof(SharedTask), alignof(SharedTask));
+	assert(t);
+	t->function = function;
+	t->arg = arg;
+
+	BikeShed_TaskFunc func = &shared_task_entry;
+	void *context = t;
+	Bikeshed_TaskID id;
+	int ok = Bikeshed_CreateTasks(shed, 1, &func, &context, &id);
+	assert(ok);
+	header->outstanding.fetch_add(1);
+	return id;
+}
+
+void SharedPool::add_dependencies(uint32_t task, const uint32_t *dependencies, unsigned num_dependencies)
+{
+	int ok = Bikeshed_AddDependencies(shed, 1, &task, num_dependencies, dependencies);
+	assert(ok);
+}
+
+void SharedPool::ready_tasks(const uint32_t *tasks, unsigned num_tasks)
+{
+	Bikeshed_ReadyTasks(shed, num_tasks, tasks);
+}
+
+bool SharedPool::do_work()
+{
+	return Bikeshed_ExecuteOne(shed, 0) != 0;
+}
+
+void SharedPool::wait()
+{
+	assert(owner);
+	bool died = false;
+	while (header->outstanding.load() != 0) {
+		if (do_work())
+			continue;
+		died = reap() || died;
+
+		// The dependents of a lost task never become ready; stop once
+		// nothing else is running
+		if (died) {
+			bool busy = false;
+			for (auto &w : header->workers)
+				busy = busy || w.task.load() != 0;
+			if (!busy)
+				break;
+		}
+		WaitForSingleObject(semaphore, 10);
+	}
+	if (header->failed.load())
+		throw std::runtime_error(header->message);
+}
+
+void SharedPool::reset()
+{
+	assert(owner && header->outstanding.load() == 0);
+	header->heap_top.store(header->heap_begin);
+	header->failed.store(0);
+}
+
+void SharedPool::serve()
+{
+	while (!header->quit.load()) {
+		if (!do_work())
+			WaitForSingleObject(semaphore, 100);
+	}
+}
+
+bool SharedPool::reap()
+{
+	bool died = false;
+	for (unsigned i = 0; i < MAX_WORKERS; ++i) {
+		Header::Worker &w = header->workers[i];
+		uint32_t pid = w.pid.load();
+		if (pid != watched_pid[i]) {
+			if (watched[i])
+				CloseHandle(watched[i]);
+			watched[i] = pid ? OpenProcess(SYNCHRONIZE, FALSE, pid) : nullptr;
+			watched_pid[i] = pid;
+		}
+		if (!pid || (watched[i] && WaitForSingleObject(watched[i], 0) == WAIT_TIMEOUT))
+			continue;
+
+		// Exited, or gone before it could be opened
+		uint32_t task = w.task.exchange(0);
+		if (task) {
+			fail(*header, "worker process %lu exited while running task %u", (unsigned long)pid, task);
+			died = true;
+		}
+		if (watched[i])
+			CloseHandle(watched[i]);
+		watched[i] = nullptr;
+		watched_pid[i] = 0;
+		w.pid.store(0);
+	}
+	return died;
+}
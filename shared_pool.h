@@ -0,0 +1,88 @@
+#pragma once
+
+#include "task_graph.h"
+#include "bikeshed.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/** Body of a shared task; arg points into the segment. */
+typedef void (*SharedTaskFunc)(void *arg);
+
+/**
+ * Task pool whose shed lives in a named shared memory segment, so that
+ * worker processes on the same host run its tasks.
+ *
+ * Tasks are plain functions looked up by id in a table that every process
+ * fills the same way before it creates or attaches. Each process maps the
+ * segment at the address its creator got, so pointers into it stay valid
+ * everywhere and tasks hand data over through allocate()d memory instead
+ * of serializing it. This only holds for processes of the same executable,
+ * which attach() checks.
+ *
+ * A worker process that dies takes only the task it was running with it;
+ * wait() on the creating side then reports the run as failed instead of
+ * hanging, and the segment should be created anew since that task's
+ * dependents never leave the shed.
+ */
+struct SharedPool
+{
+	enum { MAX_FUNCTIONS = 256, MAX_WORKERS = 64 };
+
+	struct Header;
+
+	Header *header;
+	Bikeshed shed;
+	void *mapping;
+	void *semaphore;
+	bool owner;
+	unsigned slot; // worker slot of this process, ~0u unless serving
+
+	SharedTaskFunc functions[MAX_FUNCTIONS];
+
+	// Creator side: worker processes started by launch() and handles of
+	// every worker slot, opened when first seen
+	std::vector<void *> launched;
+	void *watched[MAX_WORKERS];
+	uint32_t watched_pid[MAX_WORKERS];
+
+	SharedPool();
+	~SharedPool();
+
+	/** Binds id to f in this process; do it before create() or attach(). */
+	void register_function(uint32_t id, SharedTaskFunc f);
+
+	/** Creates the segment with room for the shed and `bytes` of task data. */
+	bool create(const char *name, std::size_t bytes, uint32_t max_tasks, uint32_t max_dependencies);
+
+	/** Maps an existing segment; fails if its address is taken here or it was made by another executable. */
+	bool attach(const char *name);
+
+	/** Starts num_processes copies of this executable with args, which are expected to attach() and serve(). */
+	bool launch(unsigned num_processes, const char *args);
+
+	/** Tells workers to exit and waits for the launched ones, then unmaps. */
+	void close();
+
+	/** Memory in the segment, valid in every process until reset(); nullptr once full. */
+	void *allocate(std::size_t bytes, std::size_t alignment = 16);
+
+	uint32_t add_task(uint32_t function, void *arg);
+	void add_dependencies(uint32_t task, const uint32_t *dependencies, unsigned num_dependencies);
+	void ready_tasks(const uint32_t *tasks, unsigned num_tasks);
+
+	bool do_work();
+
+	/** Helps until every added task has run; throws std::runtime_error if a task threw or its worker died. */
+	void wait();
+
+	/** Frees all allocations for the next run; only between runs. */
+	void reset();
+
+	/** Worker process loop: runs tasks until the creator closes the pool. */
+	void serve();
+
+	/** Frees the slots of worker processes that have exited; true if one died running a task. */
+	bool reap();
+};
@@ -0,0 +1,439 @@
+#include "slice_kernels.h"
+
+#include <immintrin.h>
+#include <limits>
+
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#	define KERNEL_TARGET(isa)
+#else
+#	include <cpuid.h>
+#	define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace
+{
+
+// Scalar reference implementations, also used for chunk tails
+
+template<typename T>
+T sum_scalar(const T *data, unsigned count)
+{
+	T result = 0;
+	for (unsigned i = 0; i < count; ++i)
+		result += data[i];
+	return result;
+}
+
+template<typename T>
+T min_scalar(const T *data, unsigned count, T result)
+{
+	for (unsigned i = 0; i < count; ++i)
+		if (data[i] < result)
+			result = data[i];
+	return result;
+}
+
+template<typename T>
+T max_scalar(const T *data, unsigned count, T result)
+{
+	for (unsigned i = 0; i < count; ++i)
+		if (data[i] > result)
+			result = data[i];
+	return result;
+}
+
+template<typename T>
+void transform_scalar(T *dst, const T *src, unsigned count, T mul, T add)
+{
+	for (unsigned i = 0; i < count; ++i)
+		dst[i] = src[i] * mul + add;
+}
+
+template<typename T>
+T prefix_sum_scalar(T *data, unsigned count, T carry)
+{
+	for (unsigned i = 0; i < count; ++i)
+		data[i] = carry = carry + data[i];
+	return carry;
+}
+
+uint32_t sum_u32_scalar(const uint32_t *data, unsigned count) { return sum_scalar(data, count); }
+float sum_f32_scalar(const float *data, unsigned count) { return sum_scalar(data, count); }
+uint32_t min_u32_scalar(const uint32_t *data, unsigned count) { return min_scalar(data, count, std::numeric_limits<uint32_t>::max()); }
+float min_f32_scalar(const float *data, unsigned count) { return min_scalar(data, count, std::numeric_limits<float>::infinity()); }
+uint32_t max_u32_scalar(const uint32_t *data, unsigned count) { return max_scalar(data, count, uint32_t(0)); }
+float max_f32_scalar(const float *data, unsigned count) { return max_scalar(data, count, -std::numeric_limits<float>::infinity()); }
+void transform_u32_scalar(uint32_t *dst, const uint32_t *src, unsigned count, uint32_t mul, uint32_t add) { transform_scalar(dst, src, count, mul, add); }
+void transform_f32_scalar(float *dst, const float *src, unsigned count, float mul, float add) { transform_scalar(dst, src, count, mul, add); }
+uint32_t prefix_sum_u32_scalar(uint32_t *data, unsigned count, uint32_t carry) { return prefix_sum_scalar(data, count, carry); }
+float prefix_sum_f32_scalar(float *data, unsigned count, float carry) { return prefix_sum_scalar(data, count, carry); }
+
+// AVX2
+
+KERNEL_TARGET("avx2") uint32_t hsum_u32_avx2(__m256i v)
+{
+	__m128i x = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+	x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32_t)_mm_cvtsi128_si32(x);
+}
+
+KERNEL_TARGET("avx2") float hsum_f32_avx2(__m256 v)
+{
+	__m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+	x = _mm_add_ss(x, _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 1, 1, 1)));
+	return _mm_cvtss_f32(x);
+}
+
+KERNEL_TARGET("avx2") uint32_t sum_u32_avx2(const uint32_t *data, unsigned count)
+{
+	__m256i a0 = _mm256_setzero_si256();
+	__m256i a1 = _mm256_setzero_si256();
+	unsigned i = 0;
+	for (; i + 16 <= count; i += 16) {
+		a0 = _mm256_add_epi32(a0, _mm256_loadu_si256((const __m256i *)(data + i)));
+		a1 = _mm256_add_epi32(a1, _mm256_loadu_si256((const __m256i *)(data + i + 8)));
+	}
+	for (; i + 8 <= count; i += 8)
+		a0 = _mm256_add_epi32(a0, _mm256_loadu_si256((const __m256i *)(data + i)));
+	return hsum_u32_avx2(_mm256_add_epi32(a0, a1)) + sum_scalar(data + i, count - i);
+}
+
+KERNEL_TARGET("avx2") float sum_f32_avx2(const float *data, unsigned count)
+{
+	__m256 a0 = _mm256_setzero_ps();
+	__m256 a1 = _mm256_setzero_ps();
+	unsigned i = 0;
+	for (; i + 16 <= count; i += 16) {
+		a0 = _mm256_add_ps(a0, _mm256_loadu_ps(data + i));
+		a1 = _mm256_add_ps(a1, _mm256_loadu_ps(data + i + 8));
+	}
+	for (; i + 8 <= count; i += 8)
+		a0 = _mm256_add_ps(a0, _mm256_loadu_ps(data + i));
+	return hsum_f32_avx2(_mm256_add_ps(a0, a1)) + sum_scalar(data + i, count - i);
+}
+
+KERNEL_TARGET("avx2") uint32_t min_u32_avx2(const uint32_t *data, unsigned count)
+{
+	__m256i m = _mm256_set1_epi32(-1);
+	unsigned i = 0;
+	for (; i + 8 <= count; i += 8)
+		m = _mm256_min_epu32(m, _mm256_loadu_si256((const __m256i *)(data + i)));
+	__m128i x = _mm_min_epu32(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+	x = _mm_min_epu32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+	x = _mm_min_epu32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+	return min_scalar(data + i, count - i, (uint32_t)_mm_cvtsi128_si32(x));
+}
+
+KERNEL_TARGET("avx2") uint32_t max_u32_avx2(const uint32_t *data, unsigned count)
+{
+	__m256i m = _mm256_setzero_si256();
+	unsigned i = 0;
+	for (; i + 8 <= count; i += 8)
+		m = _mm256_max_epu32(m, _mm256_loadu_si256((const __m256i *)(data + i)));
+	__m128i x = _mm_max_epu32(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+	x = _mm_max_epu32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+	x = _mm_max_epu32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+	return max_scalar(data + i, count - i, (uint32_t)_mm_cvtsi128_si32(x));
+}
+
+KERNEL_TARGET("avx2") float min_f32_avx2(const float *data, unsigned count)
+{
+	__m256 m = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+	unsigned i = 0;
+	for (; i + 8 <= count; i += 8)
+		m = _mm256_min_ps(m, _mm256_loadu_ps(data + i));
+	__m128 x = _mm_min_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+	x = _mm_min_ps(x, _mm_movehl_ps(x, x));
+	x = _mm_min_ss(x, _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 1, 1, 1)));
+	return min_scalar(data + i, count - i, _mm_cvtss_f32(x));
+}
+
+KERNEL_TARGET("avx2") float max_f32_avx2(const float *data, unsigned count)
+{
+	__m256 m = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+	unsigned i = 0;
+	for (; i + 8 <= count; i += 8)
+		m = _mm256_max_ps(m, _mm256_loadu_ps(data + i));
+	__m128 x = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+	x = _mm_max_ps(x, _mm_movehl_ps(x, x));
+	x = _mm_max_ss(x, _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 1, 1, 1)));
+	return max_scalar(data + i, count - i, _mm_cvtss_f32(x));
+}
+
+KERNEL_TARGET("avx2") void transform_u32_avx2(uint32_t *dst, const uint32_t *src, unsigned count, uint32_t mul, uint32_t add)
+{
+	__m256i m = _mm256_set1_epi32((int)mul);
+	__m256i a = _mm256_set1_epi32((int)add);
+	unsigned i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(_mm256_mullo_epi32(x, m), a));
+	}
+	transform_scalar(dst + i, src + i, count - i, mul, add);
+}
+
+KERNEL_TARGET("avx2") void transform_f32_avx2(float *dst, const float *src, unsigned count, float mul, float add)
+{
+	__m256 m = _mm256_set1_ps(mul);
+	__m256 a = _mm256_set1_ps(add);
+	unsigned i = 0;
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), m), a));
+	transform_scalar(dst + i, src + i, count - i, mul, add);
+}
+
+// Scan within each 128-bit lane, then carry the low lane's total into the high lane.
+KERNEL_TARGET("avx2") uint32_t prefix_sum_u32_avx2(uint32_t *data, unsigned count, uint32_t carry)
+{
+	__m256i c = _mm256_set1_epi32((int)carry);
+	__m256i last = _mm256_set1_epi32(7);
+	unsigned i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+		x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+		x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+		__m256i lo = _mm256_permute2x128_si256(x, x, 0x08);
+		x = _mm256_add_epi32(x, _mm256_shuffle_epi32(lo, _MM_SHUFFLE(3, 3, 3, 3)));
+		x = _mm256_add_epi32(x, c);
+		_mm256_storeu_si256((__m256i *)(data + i), x);
+		c = _mm256_permutevar8x32_epi32(x, last);
+	}
+	return prefix_sum_scalar(data + i, count - i, (uint32_t)_mm256_cvtsi256_si32(c));
+}
+
+KERNEL_TARGET("avx2") float prefix_sum_f32_avx2(float *data, unsigned count, float carry)
+{
+	__m256 c = _mm256_set1_ps(carry);
+	__m256i last = _mm256_set1_epi32(7);
+	unsigned i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 x = _mm256_loadu_ps(data + i);
+		x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 4)));
+		x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 8)));
+		__m256 lo = _mm256_permute2f128_ps(x, x, 0x08);
+		x = _mm256_add_ps(x, _mm256_shuffle_ps(lo, lo, _MM_SHUFFLE(3, 3, 3, 3)));
+		x = _mm256_add_ps(x, c);
+		_mm256_storeu_ps(data + i, x);
+		c = _mm256_permutevar8x32_ps(x, last);
+	}
+	return prefix_sum_scalar(data + i, count - i, _mm256_cvtss_f32(c));
+}
+
+// AVX-512F, prefix sums reuse the AVX2 versions
+
+KERNEL_TARGET("avx512f") uint32_t sum_u32_avx512(const uint32_t *data, unsigned count)
+{
+	__m512i a0 = _mm512_setzero_si512();
+	__m512i a1 = _mm512_setzero_si512();
+	unsigned i = 0;
+	for (; i + 32 <= count; i += 32) {
+		a0 = _mm512_add_epi32(a0, _mm512_loadu_si512(data + i));
+		a1 = _mm512_add_epi32(a1, _mm512_loadu_si512(data + i + 16));
+	}
+	for (; i + 16 <= count; i += 16)
+		a0 = _mm512_add_epi32(a0, _mm512_loadu_si512(data + i));
+	return (uint32_t)_mm512_reduce_add_epi32(_mm512_add_epi32(a0, a1)) + sum_scalar(data + i, count - i);
+}
+
+KERNEL_TARGET("avx512f") float sum_f32_avx512(const float *data, unsigned count)
+{
+	__m512 a0 = _mm512_setzero_ps();
+	__m512 a1 = _mm512_setzero_ps();
+	unsigned i = 0;
+	for (; i + 32 <= count; i += 32) {
+		a0 = _mm512_add_ps(a0, _mm512_loadu_ps(data + i));
+		a1 = _mm512_add_ps(a1, _mm512_loadu_ps(data + i + 16));
+	}
+	for (; i + 16 <= count; i += 16)
+		a0 = _mm512_add_ps(a0, _mm512_loadu_ps(data + i));
+	return _mm512_reduce_add_ps(_mm512_add_ps(a0, a1)) + sum_scalar(data + i, count - i);
+}
+
+KERNEL_TARGET("avx512f") uint32_t min_u32_avx512(const uint32_t *data, unsigned count)
+{
+	__m512i m = _mm512_set1_epi32(-1);
+	unsigned i = 0;
+	for (; i + 16 <= count; i += 16)
+		m = _mm512_min_epu32(m, _mm512_loadu_si512(data + i));
+	return min_scalar(data + i, count - i, (uint32_t)_mm512_reduce_min_epu32(m));
+}
+
+KERNEL_TARGET("avx512f") uint32_t max_u32_avx512(const uint32_t *data, unsigned count)
+{
+	__m512i m = _mm512_setzero_si512();
+	unsigned i = 0;
+	for (; i + 16 <= count; i += 16)
+		m = _mm512_max_epu32(m, _mm512_loadu_si512(data + i));
+	return max_scalar(data + i, count - i, (uint32_t)_mm512_reduce_max_epu32(m));
+}
+
+KERNEL_TARGET("avx512f") float min_f32_avx512(const float *data, unsigned count)
+{
+	__m512 m = _mm512_set1_ps(std::numeric_limits<float>::infinity());
+	unsigned i = 0;
+	for (; i + 16 <= count; i += 16)
+		m = _mm512_min_ps(m, _mm512_loadu_ps(data + i));
+	return min_scalar(data + i, count - i, _mm512_reduce_min_ps(m));
+}
+
+KERNEL_TARGET("avx512f") float max_f32_avx512(const float *data, unsigned count)
+{
+	__m512 m = _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+	unsigned i = 0;
+	for (; i + 16 <= count; i += 16)
+		m = _mm512_max_ps(m, _mm512_loadu_ps(data + i));
+	return max_scalar(data + i, count - i, _mm512_reduce_max_ps(m));
+}
+
+KERNEL_TARGET("avx512f") void transform_u32_avx512(uint32_t *dst, const uint32_t *src, unsigned count, uint32_t mul, uint32_t add)
+{
+	__m512i m = _mm512_set1_epi32((int)mul);
+	__m512i a = _mm512_set1_epi32((int)add);
+	unsigned i = 0;
+	for (; i + 16 <= count; i += 16)
+		_mm512_storeu_si512(dst + i, _mm512_add_epi32(_mm512_mullo_epi32(_mm512_loadu_si512(src + i), m), a));
+	transform_scalar(dst + i, src + i, count - i, mul, add);
+}
+
+KERNEL_TARGET("avx512f") void transform_f32_avx512(float *dst, const float *src, unsigned count, float mul, float add)
+{
+	__m512 m = _mm512_set1_ps(mul);
+	__m512 a = _mm512_set1_ps(add);
+	unsigned i = 0;
+	for (; i + 16 <= count; i += 16)
+		_mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_mul_ps(_mm512_loadu_ps(src + i), m), a));
+	transform_scalar(dst + i, src + i, count - i, mul, add);
+}
+
+// Runtime dispatch
+
+struct KernelTable
+{
+	kernels::Isa isa;
+	const char *name;
+	unsigned vector_bytes;
+	uint32_t (*sum_u32)(const uint32_t *, unsigned);
+	float (*sum_f32)(const float *, unsigned);
+	uint32_t (*min_u32)(const uint32_t *, unsigned);
+	float (*min_f32)(const float *, unsigned);
+	uint32_t (*max_u32)(const uint32_t *, unsigned);
+	float (*max_f32)(const float *, unsigned);
+	void (*transform_u32)(uint32_t *, const uint32_t *, unsigned, uint32_t, uint32_t);
+	void (*transform_f32)(float *, const float *, unsigned, float, float);
+	uint32_t (*prefix_sum_u32)(uint32_t *, unsigned, uint32_t);
+	float (*prefix_sum_f32)(float *, unsigned, float);
+};
+
+const KernelTable scalar_table = {
+	kernels::Isa::Scalar, "scalar", (unsigned)sizeof(uint32_t),
+	sum_u32_scalar, sum_f32_scalar,
+	min_u32_scalar, min_f32_scalar,
+	max_u32_scalar, max_f32_scalar,
+	transform_u32_scalar, transform_f32_scalar,
+	prefix_sum_u32_scalar, prefix_sum_f32_scalar,
+};
+
+const KernelTable avx2_table = {
+	kernels::Isa::AVX2, "avx2", 32,
+	sum_u32_avx2, sum_f32_avx2,
+	min_u32_avx2, min_f32_avx2,
+	max_u32_avx2, max_f32_avx2,
+	transform_u32_avx2, transform_f32_avx2,
+	prefix_sum_u32_avx2, prefix_sum_f32_avx2,
+};
+
+const KernelTable avx512_table = {
+	kernels::Isa::AVX512, "avx512f", 64,
+	sum_u32_avx512, sum_f32_avx512,
+	min_u32_avx512, min_f32_avx512,
+	max_u32_avx512, max_f32_avx512,
+	transform_u32_avx512, transform_f32_avx512,
+	prefix_sum_u32_avx2, prefix_sum_f32_avx2,
+};
+
+void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuidex(r, (int)leaf, (int)subleaf);
+	for (unsigned i = 0; i < 4; ++i)
+		regs[i] = (unsigned)r[i];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+uint64_t xgetbv0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+const KernelTable &detect()
+{
+	unsigned regs[4];
+	cpuid(0, 0, regs);
+	if (regs[0] < 7)
+		return scalar_table;
+
+	// OS must save the wider register state, not just the CPU support it
+	cpuid(1, 0, regs);
+	bool osxsave = (regs[2] & (1u << 27)) != 0;
+	bool avx = (regs[2] & (1u << 28)) != 0;
+	if (!osxsave || !avx)
+		return scalar_table;
+
+	uint64_t xcr0 = xgetbv0();
+	if ((xcr0 & 0x6) != 0x6)
+		return scalar_table;
+
+	cpuid(7, 0, regs);
+	bool avx2 = (regs[1] & (1u << 5)) != 0;
+	bool avx512f = (regs[1] & (1u << 16)) != 0;
+
+	if (avx512f && (xcr0 & 0xe6) == 0xe6)
+		return avx512_table;
+	if (avx2)
+		return avx2_table;
+	return scalar_table;
+}
+
+const KernelTable &table()
+{
+	static const KernelTable &t = detect();
+	return t;
+}
+
+} // anonymous
+
+namespace kernels
+{
+
+Isa isa() { return table().isa; }
+const char *isa_name() { return table().name; }
+unsigned vector_bytes() { return table().vector_bytes; }
+
+uint32_t sum(const uint32_t *data, unsigned count) { return table().sum_u32(data, count); }
+float sum(const float *data, unsigned count) { return table().sum_f32(data, count); }
+
+uint32_t minimum(const uint32_t *data, unsigned count) { return table().min_u32(data, count); }
+float minimum(const float *data, unsigned count) { return table().min_f32(data, count); }
+
+uint32_t maximum(const uint32_t *data, unsigned count) { return table().max_u32(data, count); }
+float maximum(const float *data, unsigned count) { return table().max_f32(data, count); }
+
+void transform(uint32_t *dst, const uint32_t *src, unsigned count, uint32_t mul, uint32_t add) { table().transform_u32(dst, src, count, mul, add); }
+void transform(float *dst, const float *src, unsigned count, float mul, float add) { table().transform_f32(dst, src, count, mul, add); }
+
+uint32_t prefix_sum(uint32_t *data, unsigned count, uint32_t carry) { return table().prefix_sum_u32(data, count, carry); }
+float prefix_sum(float *data, unsigned count, float carry) { return table().prefix_sum_f32(data, count, carry); }
+
+} // kernels
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "task_graph.h"
+
+#include <cstdint>
+
+/**
+ * Vectorized kernels for slice() bodies.
+ *
+ * Every entry point is resolved once, on first use, to the widest instruction
+ * set the CPU and OS support (AVX-512F, AVX2 or plain scalar code). Loads are
+ * unaligned-safe and the tail of a chunk is handled with scalar code, so any
+ * chunk can be passed in; slice() with simd_settings() additionally places
+ * every chunk but the first on a vector boundary.
+ */
+
+namespace kernels
+{
+	enum class Isa
+	{
+		Scalar,
+		AVX2,
+		AVX512,
+	};
+
+	Isa isa();
+	const char *isa_name();
+
+	/** Width in bytes of the vectors used by the dispatched kernels. */
+	unsigned vector_bytes();
+
+	uint32_t sum(const uint32_t *data, unsigned count);
+	float sum(const float *data, unsigned count);
+
+	uint32_t minimum(const uint32_t *data, unsigned count);
+	float minimum(const float *data, unsigned count);
+
+	uint32_t maximum(const uint32_t *data, unsigned count);
+	float maximum(const float *data, unsigned count);
+
+	/** dst[i] = src[i] * mul + add. dst may equal src. */
+	void transform(uint32_t *dst, const uint32_t *src, unsigned count, uint32_t mul, uint32_t add);
+	void transform(float *dst, const float *src, unsigned count, float mul, float add);
+
+	/** In-place inclusive prefix sum seeded with carry. Returns the last element (carry if empty). */
+	uint32_t prefix_sum(uint32_t *data, unsigned count, uint32_t carry);
+	float prefix_sum(float *data, unsigned count, float carry);
+} // kernels
+
+/** Slice settings whose chunks hold a whole number of vector lanes. */
+template<typename T>
+SliceSettings simd_settings(unsigned max_chunks)
+{
+	unsigned lanes = kernels::vector_bytes() / sizeof(T);
+	if (lanes == 0)
+		lanes = 1;
+	while (lanes & (lanes - 1))
+		lanes &= lanes - 1;
+
+	SliceSettings s;
+	s.max_chunks = max_chunks;
+	s.min_chunk_size = lanes;
+	s.alignment = lanes;
+	return s;
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include "task_graph.h"
+
+#include <cassert>
+#include <tuple>
+#include <type_traits>
+
+/**
+ * Task graph whose shape is fixed by its task types.
+ *
+ * Every task type appears once in Tasks...; the Deps... of each Task<Deps...>
+ * or TaskFn<F, Deps...> name other types in the pack. Topological order,
+ * roots and dependency lists are computed at compile time, so
+ * submit() only creates the tasks and replays constant index arrays. Cycles,
+ * repeated types and dependencies outside the pack fail to compile.
+ */
+
+namespace detail
+{
+	template<typename... D>
+	std::tuple<D...> static_task_deps(const Task<D...> *);
+
+	template<typename F, typename... D>
+	std::tuple<D...> static_task_deps(const TaskFn<F, D...> *);
+
+	std::tuple<> static_task_deps(const TaskBase *);
+
+	template<typename T>
+	using StaticTaskDeps = decltype(static_task_deps(static_cast<T *>(nullptr)));
+
+	enum : unsigned { STATIC_TASK_MISSING = 0x40000000 };
+
+	template<typename T, typename... Ts>
+	struct StaticTaskIndex : std::integral_constant<unsigned, STATIC_TASK_MISSING> {};
+
+	template<typename T, typename... Ts>
+	struct StaticTaskIndex<T, T, Ts...> : std::integral_constant<unsigned, 0> {};
+
+	template<typename T, typename U, typename... Ts>
+	struct StaticTaskIndex<T, U, Ts...> : std::integral_constant<unsigned, 1 + StaticTaskIndex<T, Ts...>::value> {};
+
+	template<typename Deps, typename... Ts>
+	struct StaticDepIndices;
+
+	template<typename... D, typename... Ts>
+	struct StaticDepIndices<std::tuple<D...>, Ts...>
+	{
+		enum { count = sizeof...(D) };
+
+		static constexpr unsigned at(unsigned j)
+		{
+			const unsigned v[] = { StaticTaskIndex<D, Ts...>::value..., 0u };
+			return v[j];
+		}
+	};
+
+	template<typename... Ts>
+	struct StaticEdgeCount;
+
+	template<>
+	struct StaticEdgeCount<> : std::integral_constant<unsigned, 0> {};
+
+	template<typename T, typename... Ts>
+	struct StaticEdgeCount<T, Ts...>
+		: std::integral_constant<unsigned, std::tuple_size<StaticTaskDeps<T>>::value + StaticEdgeCount<Ts...>::value> {};
+
+	/** All indices are positions in topological order, except `order` which maps positions to Tasks... indices. */
+	template<unsigned N, unsigned E>
+	struct StaticTopology
+	{
+		unsigned order[N];
+		unsigned num_deps[N];
+		unsigned dep_first[N];
+		unsigned deps[E ? E : 1];
+		unsigned num_roots;
+		bool unique;
+		bool complete;
+		bool acyclic;
+	};
+
+	template<unsigned N, unsigned E>
+	struct StaticEdges
+	{
+		unsigned num_deps[N];
+		unsigned dep_first[N];
+		unsigned deps[E ? E : 1];
+		bool unique;
+		bool complete;
+	};
+
+	template<typename T, typename... Ts, unsigned N, unsigned E>
+	constexpr int static_fill_edges(StaticEdges<N, E> &g, unsigned &i, unsigned &e)
+	{
+		typedef StaticDepIndices<StaticTaskDeps<T>, Ts...> D;
+		g.unique = g.unique && StaticTaskIndex<T, Ts...>::value == i;
+		g.num_deps[i] = D::count;
+		g.dep_first[i] = e;
+		for (unsigned j = 0; j < (unsigned)D::count; ++j) {
+			g.deps[e] = D::at(j);
+			g.complete = g.complete && g.deps[e] < N;
+			++e;
+		}
+		++i;
+		return 0;
+	}
+
+	template<typename... Ts>
+	constexpr StaticTopology<sizeof...(Ts), StaticEdgeCount<Ts...>::value> static_topology()
+	{
+		const unsigned N = sizeof...(Ts);
+		const unsigned E = StaticEdgeCount<Ts...>::value;
+
+		StaticEdges<N, E> g{};
+		g.unique = true;
+		g.complete = true;
+		unsigned i = 0, e = 0;
+		int dummy[] = { static_fill_edges<Ts, Ts...>(g, i, e)... };
+		(void)dummy;
+
+		StaticTopology<N, E> t{};
+		t.unique = g.unique;
+		t.complete = g.complete;
+		if (!t.unique || !t.complete)
+			return t;
+
+		// Kahn's algorithm in waves, so the roots take the first positions
+		unsigned remaining[N] = {};
+		unsigned position[N] = {};
+		bool placed[N] = {};
+		for (unsigned k = 0; k < N; ++k)
+			remaining[k] = g.num_deps[k];
+
+		unsigned count = 0;
+		while (count < N) {
+			unsigned wave_begin = count;
+			for (unsigned k = 0; k < N; ++k) {
+				if (!placed[k] && remaining[k] == 0) {
+					placed[k] = true;
+					position[k] = count;
+					t.order[count++] = k;
+				}
+			}
+			if (count == wave_begin)
+				break;
+			if (wave_begin == 0)
+				t.num_roots = count;
+
+			for (unsigned w = wave_begin; w < count; ++w)
+				for (unsigned k = 0; k < N; ++k)
+					for (unsigned j = 0; j < g.num_deps[k]; ++j)
+						if (g.deps[g.dep_first[k] + j] == t.order[w])
+							--remaining[k];
+		}
+
+		t.acyclic = count == N;
+		if (!t.acyclic)
+			return t;
+
+		unsigned d = 0;
+		for (unsigned p = 0; p < N; ++p) {
+			unsigned k = t.order[p];
+			t.num_deps[p] = g.num_deps[k];
+			t.dep_first[p] = d;
+			for (unsigned j = 0; j < g.num_deps[k]; ++j)
+				t.deps[d++] = position[g.deps[g.dep_first[k] + j]];
+		}
+
+		return t;
+	}
+} // detail
+
+template<typename... Tasks>
+struct StaticTaskGraph
+{
+	enum : unsigned
+	{
+		NUM_TASKS = sizeof...(Tasks),
+		NUM_EDGES = detail::StaticEdgeCount<Tasks...>::value,
+	};
+
+	static_assert(NUM_TASKS > 0, "StaticTaskGraph needs at least one task");
+
+	typedef detail::StaticTopology<NUM_TASKS, NUM_EDGES> Topology;
+	static constexpr Topology topology = detail::static_topology<Tasks...>();
+
+	static_assert(topology.unique, "every task type may appear only once in a StaticTaskGraph");
+	static_assert(topology.complete, "a dependency type is not part of the StaticTaskGraph");
+	static_assert(!topology.unique || !topology.complete || topology.acyclic, "StaticTaskGraph has a dependency cycle");
+
+	// Tasks in topological order
+	TaskBase *units[NUM_TASKS];
+	BikeShed_TaskFunc funcs[NUM_TASKS];
+	TaskGraphFence fence;
+	TaskFailure failure;
+
+	StaticTaskGraph(Tasks&... t) : fence()
+	{
+		TaskBase *declared[] = { static_cast<TaskBase *>(&t)... };
+		BikeShed_TaskFunc declared_funcs[] = { task_entry_for(t)... };
+		for (unsigned p = 0; p < NUM_TASKS; ++p) {
+			units[p] = declared[topology.order[p]];
+			funcs[p] = declared_funcs[topology.order[p]];
+		}
+		fence.failure = &failure;
+
+#if !defined(NDEBUG)
+		// The instances passed in must be the ones the tasks were wired to
+		for (unsigned p = 0; p < NUM_TASKS; ++p) {
+			assert(units[p]->num_inputs == topology.num_deps[p]);
+			for (unsigned j = 0; j < topology.num_deps[p]; ++j)
+				assert(units[p]->inputs[j] == units[topology.deps[topology.dep_first[p] + j]]);
+		}
+#endif
+	}
+
+	void submit(ThreadPoolInterface &pool)
+	{
+		fence.rearm();
+		fence.outstanding.store(NUM_TASKS, std::memory_order_relaxed);
+		failure.reset();
+
+		// A TaskGraph over the same tasks points them at itself whenever
+		// it is submitted, so claim them back on every submit
+		for (TaskBase *u : units) {
+			u->token = nullptr;
+			u->failure = &failure;
+			u->completion = &fence;
+			u->budget = nullptr;
+			u->hold = nullptr;
+		}
+
+		uint32_t ids[NUM_TASKS];
+		pool.add_tasks(units, funcs, NUM_TASKS, ids);
+
+		uint32_t dep_ids[NUM_EDGES > 0 ? NUM_EDGES : 1];
+		for (unsigned p = topology.num_roots; p < NUM_TASKS; ++p) {
+			unsigned first = topology.dep_first[p];
+			for (unsigned j = 0; j < topology.num_deps[p]; ++j)
+				dep_ids[j] = ids[topology.deps[first + j]];
+			pool.add_dependencies(&ids[p], 1, dep_ids, topology.num_deps[p]);
+		}
+
+		pool.ready_tasks(ids, topology.num_roots);
+	}
+
+	/** Rethrows the first exception of the run, like TaskGraph::wait(). */
+	void wait(ThreadPoolInterface &pool)
+	{
+		while (fence.signal.load(std::memory_order_acquire) == 0)
+			if (!pool.do_work())
+				pool.yield();
+		if (failure.error)
+			std::rethrow_exception(failure.error);
+	}
+};
+
+template<typename... Tasks>
+constexpr typename StaticTaskGraph<Tasks...>::Topology StaticTaskGraph<Tasks...>::topology;
@@ -0,0 +1,355 @@
+#pragma once
+
+#include "task_graph.h"
+#include "slice_kernels.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+// Parallel prefix scan
+
+enum class ScanMode
+{
+	Inclusive,
+	Exclusive,
+};
+
+namespace detail
+{
+	template<typename T, typename Op>
+	T scan_reduce(const T *data, unsigned count, T carry, Op &op)
+	{
+		for (unsigned i = 0; i < count; ++i)
+			carry = op(carry, data[i]);
+		return carry;
+	}
+
+	inline uint32_t scan_reduce(const uint32_t *data, unsigned count, uint32_t carry, std::plus<uint32_t> &)
+	{
+		return carry + kernels::sum(data, count);
+	}
+
+	template<typename T, typename Op>
+	void scan_chunk(const T *in, T *out, unsigned count, T carry, Op &op, ScanMode mode)
+	{
+		if (mode == ScanMode::Inclusive) {
+			for (unsigned i = 0; i < count; ++i)
+				out[i] = carry = op(carry, in[i]);
+		} else {
+			for (unsigned i = 0; i < count; ++i) {
+				T v = in[i];
+				out[i] = carry;
+				carry = op(carry, v);
+			}
+		}
+	}
+
+	// Copy in cache-sized blocks and scan them in place while they are still hot
+	inline void scan_chunk(const uint32_t *in, uint32_t *out, unsigned count, uint32_t carry, std::plus<uint32_t> &op, ScanMode mode)
+	{
+		if (mode == ScanMode::Exclusive) {
+			scan_chunk<uint32_t, std::plus<uint32_t>>(in, out, count, carry, op, mode);
+			return;
+		}
+
+		const unsigned block = 4096;
+		for (unsigned off = 0; off < count; off += block) {
+			unsigned n = count - off < block ? count - off : block;
+			if (out != in)
+				std::copy(in + off, in + off + n, out + off);
+			carry = kernels::prefix_sum(out + off, n, carry);
+		}
+	}
+
+	/** Serial scan over the upsweep partials, seeding each downsweep chunk with its carry-in. */
+	template<typename T, typename Op, typename Up, typename Down>
+	struct ScanCombine : TaskBase
+	{
+		std::vector<Up> &up;
+		std::vector<Down> &down;
+		std::vector<TaskBase *> deps;
+		T init;
+		Op &op;
+
+		ScanCombine(std::vector<Up> &u, std::vector<Down> &d, T i, Op &o)
+			: up(u), down(d), deps(), init(i), op(o)
+		{
+			deps.reserve(up.size());
+			for (auto &t : up)
+				deps.push_back(&t);
+			inputs = deps.data();
+			num_inputs = (unsigned)deps.size();
+		}
+
+		virtual void operator()() override
+		{
+			T carry = init;
+			for (unsigned i = 0; i < up.size(); ++i) {
+				down[i].result = carry;
+				carry = op(carry, up[i].result);
+			}
+		}
+	};
+} // detail
+
+/**
+ * Two pass reduce-then-scan over slice() chunks.
+ *
+ * The upsweep reduces every chunk in parallel, a single task scans the chunk
+ * totals into per-chunk carries, and the downsweep rescans every chunk in
+ * parallel starting from its carry. Op must be associative. init is combined
+ * in front of the first element, as with std::exclusive_scan; pass the
+ * identity of op for a plain inclusive scan. out may equal in. Blocks until
+ * done, helping the pool while waiting.
+ */
+template<typename T, typename Op>
+void parallel_scan(ThreadPoolInterface &pool, const T *in, T *out, unsigned count,
+	T init, Op op, ScanMode mode = ScanMode::Inclusive, SliceSettings s = {})
+{
+	if (count == 0)
+		return;
+
+	auto up = slice<T>(count, in, [&op](Slice<const T, T> c) {
+		c.result = detail::scan_reduce(c.data + 1, c.count - 1, c.data[0], op);
+	}, s);
+
+	auto down = slice<T>(count, in, [in, out, &op, mode](Slice<const T, T> c) {
+		detail::scan_chunk(c.data, out + (c.data - in), c.count, c.result, op, mode);
+	}, s);
+
+	typedef typename decltype(up)::value_type Up;
+	typedef typename decltype(down)::value_type Down;
+	detail::ScanCombine<T, Op, Up, Down> combine(up, down, init, op);
+
+	TaskBase *after_combine = &combine;
+	for (auto &t : down) {
+		t.inputs = &after_combine;
+		t.num_inputs = 1;
+	}
+
+	TaskGraph g;
+	g.reserve(up.size() + down.size() + 1);
+	for (auto &t : up)
+		g.add(t);
+	g.add(combine);
+	for (auto &t : down)
+		g.add(t);
+
+	g.submit(pool);
+	g.wait(pool);
+}
+
+template<typename T>
+void parallel_inclusive_scan(ThreadPoolInterface &pool, const T *in, T *out, unsigned count, SliceSettings s = {})
+{
+	parallel_scan(pool, in, out, count, T(), std::plus<T>(), ScanMode::Inclusive, s);
+}
+
+template<typename T>
+void parallel_exclusive_scan(ThreadPoolInterface &pool, const T *in, T *out, unsigned count, T init = T(), SliceSettings s = {})
+{
+	parallel_scan(pool, in, out, count, init, std::plus<T>(), ScanMode::Exclusive, s);
+}
+
+// Parallel sort
+
+namespace detail
+{
+	/** Number of elements taken from a in the first d outputs of a stable merge of a and b. */
+	template<typename T, typename Compare>
+	unsigned merge_split(const T *a, unsigned la, const T *b, unsigned lb, unsigned d, Compare &cmp)
+	{
+		unsigned lo = d > lb ? d - lb : 0;
+		unsigned hi = d < la ? d : la;
+		while (lo < hi) {
+			unsigned mid = lo + (hi - lo) / 2;
+			if (cmp(b[d - mid - 1], a[mid]))
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		return lo;
+	}
+
+	/** Output range [d0, d1) of the merge of two sorted runs. */
+	template<typename T, typename Compare>
+	struct MergePart : TaskBase
+	{
+		const T *a;
+		const T *b;
+		T *dst;
+		unsigned la, lb;
+		unsigned d0, d1;
+		Compare *cmp;
+
+		virtual void operator()() override
+		{
+			unsigned i0 = merge_split(a, la, b, lb, d0, *cmp);
+			unsigned i1 = merge_split(a, la, b, lb, d1, *cmp);
+			std::merge(a + i0, a + i1, b + (d0 - i0), b + (d1 - i1), dst + d0, *cmp);
+		}
+	};
+
+	/** Scratch memory that goes back to its pool however the scope is left. */
+	struct ScratchBlock
+	{
+		ThreadPoolInterface &pool;
+		void *p;
+
+		ScratchBlock(ThreadPoolInterface &pool, std::size_t bytes, std::size_t alignment)
+			: pool(pool), p(pool.scratch_alloc(bytes, alignment)) {}
+		~ScratchBlock() { pool.scratch_free(p); }
+
+		ScratchBlock(const ScratchBlock &) = delete;
+		ScratchBlock &operator=(const ScratchBlock &) = delete;
+	};
+
+	/**
+	 * Done once every part of a merged run is; the next round depends on it
+	 * alone. Scheduled rather than inline, since an inline task would hand
+	 * its inputs on to its dependents.
+	 */
+	struct SortJoin : TaskBase
+	{
+		virtual void operator()() override {}
+	};
+
+	struct SortRun
+	{
+		unsigned offset;
+		unsigned count;
+		TaskBase *done; // the chunk sort, single merge part or join that completes it
+	};
+} // detail
+
+/**
+ * Sorts contiguous [begin, end) with chunk local std::sort over slice()
+ * followed by rounds of pairwise merges. Every round is split into as many
+ * merge tasks as there are chunks, cut at merge path diagonals so they all
+ * write equal shares of the output. The parts of a run are gathered by a
+ * join task, so each round adds edges in proportion to the chunks. The whole
+ * thing is one graph; the ping pong buffer comes from pool.scratch_alloc(),
+ * and without one the range is sorted serially. Not stable.
+ */
+template<typename RandomIt, typename Compare>
+void parallel_sort(ThreadPoolInterface &pool, RandomIt begin, RandomIt end, Compare cmp, SliceSettings s = {})
+{
+	typedef typename std::iterator_traits<RandomIt>::value_type T;
+	static_assert(std::is_trivially_copyable<T>::value, "parallel_sort moves elements through raw scratch memory");
+
+	unsigned count = (unsigned)(end - begin);
+	T *data = count ? &*begin : nullptr;
+	unsigned chunks = num_chunks(count, s, chunk_skew(data, s));
+	if (chunks <= 1) {
+		std::sort(begin, end, cmp);
+		return;
+	}
+
+	unsigned rounds = 0;
+	while ((1u << rounds) < chunks)
+		++rounds;
+
+	// Runs alternate between the buffers every round; the chunk sorts start
+	// in whichever one makes the last merge land back in data. The scratch
+	// is released even when a comparator throws and wait() rethrows it
+	detail::ScratchBlock block(pool, sizeof(T) * count, alignof(T));
+	T *scratch = static_cast<T *>(block.p);
+	if (!scratch) {
+		std::sort(begin, end, cmp);
+		return;
+	}
+	T *buffers[2] = { data, scratch };
+	T *first = buffers[rounds & 1];
+
+	auto sorts = slice<char>(count, data, [data, first, &cmp](Slice<T, char> c) {
+		T *dst = first + (c.data - data);
+		if (dst != c.data)
+			std::copy(c.data, c.data + c.count, dst);
+		std::sort(dst, dst + c.count, cmp);
+	}, s);
+
+	// A round has at most two merge parts per chunk, each depending on the
+	// two runs it reads, and a join per merged run; reserving that keeps
+	// task and input pointers stable
+	std::vector<detail::MergePart<T, Compare>> merges;
+	std::vector<detail::SortJoin> joins;
+	std::vector<TaskBase *> deps;
+	std::vector<TaskBase *> parts_of;
+	merges.reserve(rounds * chunks * 2);
+	joins.reserve(rounds * chunks);
+	deps.reserve(rounds * (chunks + 1) * 2);
+	parts_of.reserve(rounds * chunks * 2);
+
+	std::vector<detail::SortRun> runs, next;
+	for (unsigned i = 0; i < chunks; ++i)
+		runs.push_back({ (unsigned)(sorts[i].data - data), sorts[i].count, &sorts[i] });
+
+	for (unsigned r = 0; r < rounds; ++r) {
+		T *src = buffers[(rounds - r) & 1];
+		T *dst = buffers[(rounds - r - 1) & 1];
+
+		next.clear();
+		for (unsigned p = 0; p * 2 < runs.size(); ++p) {
+			detail::SortRun a = runs[p * 2];
+			detail::SortRun b = { a.offset + a.count, 0, nullptr };
+			if (p * 2 + 1 < runs.size())
+				b = runs[p * 2 + 1];
+
+			unsigned deps_first = (unsigned)deps.size();
+			deps.push_back(a.done);
+			if (b.done)
+				deps.push_back(b.done);
+
+			unsigned len = a.count + b.count;
+			unsigned parts = (unsigned)(((uint64_t)len * chunks + count / 2) / count);
+			if (parts == 0)
+				parts = 1;
+
+			unsigned parts_first = (unsigned)parts_of.size();
+			for (unsigned j = 0; j < parts; ++j) {
+				merges.emplace_back();
+				detail::MergePart<T, Compare> &m = merges.back();
+				m.a = src + a.offset;
+				m.la = a.count;
+				m.b = src + b.offset;
+				m.lb = b.count;
+				m.dst = dst + a.offset;
+				m.d0 = (unsigned)((uint64_t)len * j / parts);
+				m.d1 = (unsigned)((uint64_t)len * (j + 1) / parts);
+				m.cmp = &cmp;
+				m.inputs = &deps[deps_first];
+				m.num_inputs = (unsigned)deps.size() - deps_first;
+				parts_of.push_back(&m);
+			}
+
+			TaskBase *done = parts_of[parts_first];
+			if (parts > 1) {
+				joins.emplace_back();
+				joins.back().inputs = &parts_of[parts_first];
+				joins.back().num_inputs = parts;
+				done = &joins.back();
+			}
+			next.push_back({ a.offset, len, done });
+		}
+		runs.swap(next);
+	}
+
+	TaskGraph g(sorts);
+	g.reserve(sorts.size() + merges.size() + joins.size());
+	for (auto &m : merges)
+		g.add(m);
+	for (auto &j : joins)
+		g.add(j);
+	g.submit(pool);
+	g.wait(pool);
+}
+
+template<typename RandomIt>
+void parallel_sort(ThreadPoolInterface &pool, RandomIt begin, RandomIt end, SliceSettings s = {})
+{
+	typedef typename std::iterator_traits<RandomIt>::value_type T;
+	parallel_sort(pool, begin, end, std::less<T>(), s);
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "task_graph.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <process.h>
+
+/** 64-bit FNV-1a over everything added to it. */
+struct TaskHash
+{
+	uint64_t value = 0xcbf29ce484222325ull;
+
+	void add(const void *data, std::size_t bytes)
+	{
+		const unsigned char *p = static_cast<const unsigned char *>(data);
+		for (std::size_t i = 0; i < bytes; ++i)
+			value = (value ^ p[i]) * 0x100000001b3ull;
+	}
+
+	template<typename T>
+	void add(const T &v)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "add() hashes raw bytes; hash the members of other types");
+		add(&v, sizeof(T));
+	}
+
+	void add(const char *s) { add(std::string(s)); }
+
+	void add(const std::string &s)
+	{
+		add(s.size());
+		add(s.data(), s.size());
+	}
+
+	template<typename T>
+	void add(const std::vector<T> &v)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "add() hashes raw bytes; hash the members of other types");
+		add(v.size());
+		add(v.data(), v.size() * sizeof(T));
+	}
+};
+
+/**
+ * Whether T may be written to disk as its raw bytes. Only arithmetic and
+ * enum types are by default, since a pointer, or a struct holding one, would
+ * be persisted as an address that means nothing to a later process.
+ * Specialize as std::true_type for trivially copyable structs without
+ * pointers.
+ */
+template<typename T>
+struct TaskCacheRawBytes : std::integral_constant<bool, std::is_arithmetic<T>::value || std::is_enum<T>::value> {};
+
+namespace detail
+{
+	template<typename T>
+	using TaskCacheRaw = std::integral_constant<bool, std::is_trivially_copyable<T>::value && TaskCacheRawBytes<T>::value
+		&& !std::is_pointer<T>::value && !std::is_member_pointer<T>::value>;
+} // detail
+
+/**
+ * How TaskCache stores outputs on disk. Raw byte types (see
+ * TaskCacheRawBytes), strings and vectors of raw byte types are supported;
+ * specialize for others, which otherwise stay in memory only.
+ */
+template<typename T, typename Enable = void>
+struct TaskCacheCodec
+{
+	enum { ON_DISK = 0 };
+	static bool write(std::FILE *, const T &) { return false; }
+	static bool read(std::FILE *, T &) { return false; }
+};
+
+template<typename T>
+struct TaskCacheCodec<T, typename std::enable_if<detail::TaskCacheRaw<T>::value>::type>
+{
+	enum { ON_DISK = 1 };
+	static bool write(std::FILE *f, const T &v) { return std::fwrite(&v, sizeof(T), 1, f) == 1; }
+	static bool read(std::FILE *f, T &v) { return std::fread(&v, sizeof(T), 1, f) == 1; }
+};
+
+template<typename T>
+struct TaskCacheCodec<std::vector<T>, typename std::enable_if<detail::TaskCacheRaw<T>::value>::type>
+{
+	enum { ON_DISK = 1 };
+
+	static bool write(std::FILE *f, const std::vector<T> &v)
+	{
+		uint64_t n = v.size();
+		return std::fwrite(&n, sizeof(n), 1, f) == 1 && (!n || std::fwrite(v.data(), sizeof(T), v.size(), f) == v.size());
+	}
+
+	static bool read(std::FILE *f, std::vector<T> &v)
+	{
+		uint64_t n;
+		if (std::fread(&n, sizeof(n), 1, f) != 1)
+			return false;
+		v.resize((std::size_t)n);
+		return !n || std::fread(v.data(), sizeof(T), v.size(), f) == v.size();
+	}
+};
+
+template<>
+struct TaskCacheCodec<std::string>
+{
+	enum { ON_DISK = 1 };
+
+	static bool write(std::FILE *f, const std::string &v)
+	{
+		uint64_t n = v.size();
+		return std::fwrite(&n, sizeof(n), 1, f) == 1 && (!n || std::fwrite(v.data(), 1, v.size(), f) == v.size());
+	}
+
+	static bool read(std::FILE *f, std::string &v)
+	{
+		uint64_t n;
+		if (std::fread(&n, sizeof(n), 1, f) != 1)
+			return false;
+		v.resize((std::size_t)n);
+		return !n || std::fread(&v[0], 1, v.size(), f) == v.size();
+	}
+};
+
+/**
+ * Outputs of CachedTasks keyed by the hash of their inputs.
+ *
+ * Keeps the `capacity` most recently used outputs in memory. With a
+ * directory, every output is also written there under its key, so a later
+ * process with the same inputs finds it on a warm start. Thread-safe.
+ */
+template<typename Out>
+struct TaskCache
+{
+	typedef std::pair<uint64_t, Out> Entry;
+
+	std::size_t capacity;
+	std::string directory;
+
+	std::mutex lock;
+	std::list<Entry> lru;
+	std::unordered_map<uint64_t, typename std::list<Entry>::iterator> index;
+
+	std::atomic<uint64_t> hits{0};
+	std::atomic<uint64_t> misses{0};
+	std::atomic<uint32_t> temp_serial{0}; // tells apart this process's concurrent writes to one key
+
+	TaskCache(std::size_t capacity, std::string directory = std::string())
+		: capacity(capacity ? capacity : 1), directory(std::move(directory)) {}
+
+	bool find(uint64_t key, Out &out)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			auto it = index.find(key);
+			if (it != index.end()) {
+				lru.splice(lru.begin(), lru, it->second);
+				out = it->second->second;
+				hits.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+
+		if (load(key, out)) {
+			remember(key, out);
+			hits.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	void insert(uint64_t key, const Out &out)
+	{
+		remember(key, out);
+		store(key, out);
+	}
+
+	void remember(uint64_t key, const Out &out)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = index.find(key);
+		if (it != index.end()) {
+			it->second->second = out;
+			lru.splice(lru.begin(), lru, it->second);
+			return;
+		}
+		lru.emplace_front(key, out);
+		index[key] = lru.begin();
+		if (lru.size() > capacity) {
+			index.erase(lru.back().first);
+			lru.pop_back();
+		}
+	}
+
+	std::string path(uint64_t key) const
+	{
+		char name[24];
+		std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+		return directory + "/" + name;
+	}
+
+	bool load(uint64_t key, Out &out)
+	{
+		if (directory.empty() || !TaskCacheCodec<Out>::ON_DISK)
+			return false;
+		std::FILE *f = std::fopen(path(key).c_str(), "rb");
+		if (!f)
+			return false;
+		Out v;
+		bool ok = TaskCacheCodec<Out>::read(f, v);
+		std::fclose(f);
+		if (ok)
+			out = std::move(v);
+		return ok;
+	}
+
+	// Written under a temporary name and renamed, so readers never see half a file
+	void store(uint64_t key, const Out &out)
+	{
+		if (directory.empty() || !TaskCacheCodec<Out>::ON_DISK)
+			return;
+		std::string final_path = path(key);
+		// Unique across processes sharing the directory, so writers never
+		// interleave in one file before the rename
+		char suffix[32];
+		std::snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", _getpid(), temp_serial.fetch_add(1, std::memory_order_relaxed));
+		std::string tmp_path = final_path + suffix;
+
+		std::FILE *f = std::fopen(tmp_path.c_str(), "wb");
+		if (!f)
+			return;
+		bool ok = TaskCacheCodec<Out>::write(f, out);
+		ok = std::fclose(f) == 0 && ok;
+		if (!ok || std::rename(tmp_path.c_str(), final_path.c_str()) != 0)
+			std::remove(tmp_path.c_str());
+	}
+};
+
+/**
+ * A pure task whose output is restored from a TaskCache when its inputs hash
+ * to a key seen before. Implement hash_inputs() over everything compute()
+ * reads; the task type and `version` are mixed into the key. Bump version
+ * whenever compute() changes, or a warm disk cache hands back outputs of the
+ * old code. On a hit compute() is skipped, but the task still runs in
+ * dependency order so dependents see `output`.
+ */
+template<typename Out, typename... Deps>
+struct CachedTask : Task<Deps...>
+{
+	TaskCache<Out> &cache;
+	Out output;
+	bool cache_hit = false;
+	uint32_t version = 0;
+
+	CachedTask(TaskCache<Out> &c, Deps&... d) : Task<Deps...>(d...), cache(c), output() {}
+
+	virtual void hash_inputs(TaskHash &h) = 0;
+	virtual void compute(Out &out) = 0;
+
+	virtual void operator()() override
+	{
+		TaskHash h;
+		h.add(typeid(*this).name());
+		h.add(version);
+		hash_inputs(h);
+
+		cache_hit = cache.find(h.value, output);
+		if (cache_hit)
+			return;
+		compute(output);
+		cache.insert(h.value, output);
+	}
+};
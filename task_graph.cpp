@@ -2,70 +2,860 @@
 
 #include "stack_allocator.h"
 
-#include <set>
 #include <algorithm>
-
-template<typename T>
-using StackSet = std::set<T, std::less<T>, StackAllocator<T>>;
+#include <utility>
+#include <cassert>
 
 template<typename T>
 using StackVector = std::vector<T, StackAllocator<T>>;
 
-void TaskGraph::submit(ThreadPoolInterface &pool)
+namespace
+{
+	TaskGraphFence::Waiter *const fence_done = reinterpret_cast<TaskGraphFence::Waiter *>(std::uintptr_t(1));
+
+	// Stands in for a fence of another graph, which readies it
+	Bikeshed_TaskResult gate_entry(Bikeshed, Bikeshed_TaskID, uint8_t, void *)
+	{
+		return BIKESHED_TASK_RESULT_COMPLETE;
+	}
+
+	// Task the calling thread's last task_entry held back for lack of memory
+	thread_local MemoryBudget *held_back_budget = nullptr;
+	thread_local MemoryBudget::Deferred held_back;
+
+	// PersistentTaskGraph::inside of the unit the calling thread's last task was
+	thread_local std::atomic<unsigned> *left_inside = nullptr;
+} // anonymous
+
+bool detail::admit(TaskBase &t, Bikeshed shed, Bikeshed_TaskID task_id)
+{
+	MemoryHold *h = t.hold;
+	if (h && !t.budget->try_reserve(shed, task_id, h->bytes)) {
+		std::size_t frees = 0;
+		for (unsigned i = 0; i < t.num_inputs; ++i)
+			if (t.inputs[i]->hold)
+				frees += t.inputs[i]->hold->bytes;
+		held_back_budget = t.budget;
+		held_back = { nullptr, shed, task_id, h->bytes, frees };
+		return false;
+	}
+	if (h)
+		h->remaining.store(h->holders, std::memory_order_relaxed);
+	t.budget->running.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void detail::release_memory(TaskBase &t)
+{
+	for (unsigned i = 0; i < t.num_inputs; ++i) {
+		MemoryHold *in = t.inputs[i]->hold;
+		if (in && in->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			in->budget->release(in->bytes);
+	}
+	t.budget->finished(t.hold && !t.hold->holders ? t.hold->bytes : 0);
+}
+
+bool MemoryBudget::try_reserve(Bikeshed shed, Bikeshed_TaskID task_id, std::size_t bytes)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	bool was_forced = forced.shed == shed && forced.task_id == task_id;
+	if (in_use + bytes > limit && in_use && !was_forced)
+		return false;
+	if (was_forced)
+		forced = Deferred{};
+	in_use += bytes;
+	peak = std::max(peak, in_use);
+	return true;
+}
+
+void MemoryBudget::finished(std::size_t bytes)
+{
+	// Counted down before locking, so a wake() that finds nothing running
+	// has seen every finished task
+	if (running.fetch_sub(1, std::memory_order_acq_rel) != 1 && !bytes)
+		return;
+	std::unique_lock<std::mutex> guard(lock);
+	in_use -= bytes;
+	wake(guard);
+}
+
+void MemoryBudget::release(std::size_t bytes)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	in_use -= bytes;
+	wake(guard);
+}
+
+void MemoryBudget::defer(const Deferred &d)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	deferred.push_back(d);
+	wake(guard);
+}
+
+void MemoryBudget::wake(std::unique_lock<std::mutex> &guard)
 {
+	// Those whose dependents release the most first, strictly in that order
+	// so a large one is not starved by smaller ones
+	std::stable_sort(deferred.begin(), deferred.end(), [](const Deferred &a, const Deferred &b) {
+		return a.frees > b.frees;
+	});
+
 	StackArena<4096> arena;
+	StackVector<Deferred> ready(StackAllocator<Deferred>{arena});
+	std::size_t room = in_use < limit ? limit - in_use : 0;
+	unsigned k = 0;
+	while (k < deferred.size() && deferred[k].bytes <= room) {
+		room -= deferred[k].bytes;
+		ready.push_back(deferred[k++]);
+	}
 
-	tasks.push_back(&fence);
+	// Nothing left to release memory, so go over rather than stall
+	if (!k && !deferred.empty() && !forced.shed && running.load(std::memory_order_acquire) == 0) {
+		forced = deferred[0];
+		ready.push_back(deferred[k++]);
+	}
+	deferred.erase(deferred.begin(), deferred.begin() + k);
+	guard.unlock();
 
-	StackVector<uint32_t> ids(StackAllocator<uint32_t>{arena});
-	ids.resize(tasks.size());
-	pool.add_tasks(tasks.data(), tasks.size(), ids.data());
+	for (Deferred &d : ready)
+		d.pool->ready_tasks(&d.task_id, 1);
+}
+
+bool ThreadPoolInterface::execute(Bikeshed shed, uint8_t channel)
+{
+	if (!Bikeshed_ExecuteOne(shed, channel))
+		return false;
+
+	// Readying a task that is still inside Bikeshed_ExecuteOne would confuse
+	// Bikeshed, so what it held back is only queued now
+	if (held_back_budget) {
+		MemoryBudget *b = held_back_budget;
+		held_back_budget = nullptr;
+		held_back.pool = this;
+		b->defer(held_back);
+	}
+	if (left_inside) {
+		left_inside->fetch_sub(1, std::memory_order_release);
+		left_inside = nullptr;
+	}
+	return true;
+}
+
+namespace detail
+{
+	/** Scheduled units of one or more graphs and the edges between them, by unit index. */
+	struct SubmitPlan
+	{
+		StackVector<TaskBase *> units;
+		StackVector<BikeShed_TaskFunc> funcs;
+		StackVector<unsigned> dep_first; // units.size() + 1 entries into deps
+		StackVector<unsigned> deps;
+		StackVector<unsigned> roots;
+		StackVector<TaskGraphFence *> idle; // fences with nothing to count down
+		unsigned segment = 0; // first unit of the graphs planned since the last add_fence()
+
+		struct Gate
+		{
+			unsigned unit;
+			TaskGraphFence *fence;
+			TaskGraphFence::Waiter *waiter;
+		};
+		StackVector<Gate> gates;
+
+		template<std::size_t N>
+		SubmitPlan(StackArena<N> &arena)
+			: units(StackAllocator<TaskBase *>{arena})
+			, funcs(StackAllocator<BikeShed_TaskFunc>{arena})
+			, dep_first(1, 0, StackAllocator<unsigned>{arena})
+			, deps(StackAllocator<unsigned>{arena})
+			, roots(StackAllocator<unsigned>{arena})
+			, idle(StackAllocator<TaskGraphFence *>{arena})
+			, gates(StackAllocator<Gate>{arena})
+		{
+		}
+
+		unsigned add_unit(TaskBase *t, BikeShed_TaskFunc f)
+		{
+			units.push_back(t);
+			funcs.push_back(f);
+			dep_first.push_back(dep_first.back());
+			return (unsigned)units.size() - 1;
+		}
+
+		void add_dependency(unsigned dep)
+		{
+			deps.push_back(dep);
+			++dep_first.back();
+		}
+
+		/** Makes every unit added since the last call count fence down; gates do not count. */
+		void add_fence(TaskGraphFence &fence)
+		{
+			fence.rearm();
+			unsigned count = 0;
+			for (unsigned u = segment; u < units.size(); ++u) {
+				if (units[u]) {
+					units[u]->completion = &fence;
+					++count;
+				}
+			}
+			segment = (unsigned)units.size();
+			fence.outstanding.store(count, std::memory_order_relaxed);
+			if (!count)
+				idle.push_back(&fence);
+		}
 
-	tasks.pop_back();
+		/** Creates every unit in one call, then wires and readies them. */
+		void submit(ThreadPoolInterface &pool, StackArena<4096> &arena)
+		{
+			StackVector<uint32_t> ids(StackAllocator<uint32_t>{arena});
+			StackVector<uint32_t> dep_ids(StackAllocator<uint32_t>{arena});
+			ids.resize(units.size());
+			if (!units.empty())
+				pool.add_tasks(units.data(), funcs.data(), (unsigned)units.size(), ids.data());
 
-	StackVector<uint32_t> roots(StackAllocator<uint32_t>{arena});
-	roots.reserve(tasks.size());
+			for (unsigned u = 0; u < units.size(); ++u) {
+				if (dep_first[u] == dep_first[u + 1])
+					continue;
+				dep_ids.clear();
+				for (unsigned j = dep_first[u]; j < dep_first[u + 1]; ++j)
+					dep_ids.push_back(ids[deps[j]]);
+				pool.add_dependencies(&ids[u], 1, dep_ids.data(), (unsigned)dep_ids.size());
+			}
 
-	StackSet<TaskBase *> has_deps(std::less<TaskBase *>{}, StackAllocator<TaskBase *>{arena});
-	for (unsigned i = 0; i < tasks.size(); ++i) {
+			// Gates of fences that have already run are ready right away
+			for (Gate &g : gates) {
+				g.waiter->next = nullptr;
+				g.waiter->pool = &pool;
+				g.waiter->task_id = ids[g.unit];
+				if (!g.fence->add_waiter(g.waiter))
+					roots.push_back(g.unit);
+			}
+
+			// Every root may be waiting on another graph
+			for (unsigned &r : roots)
+				r = ids[r];
+			if (!roots.empty())
+				pool.ready_tasks(roots.data(), (unsigned)roots.size());
+
+			for (TaskGraphFence *f : idle)
+				(*f)();
+		}
+	};
+} // detail
+
+bool TaskGraphFence::add_waiter(Waiter *w)
+{
+	Waiter *head = waiters.load(std::memory_order_acquire);
+	do {
+		if (head == fence_done)
+			return false;
+		w->next = head;
+	} while (!waiters.compare_exchange_weak(head, w, std::memory_order_release, std::memory_order_acquire));
+	return true;
+}
+
+void TaskGraphFence::operator()()
+{
+	// A fence after a single task only reflects that task
+	failed = num_inputs ? failed_input() != nullptr : failure && failure->raised.load();
+
+	// A readied waiter may complete its graph and free itself, so read next first
+	Waiter *w = waiters.exchange(fence_done, std::memory_order_acq_rel);
+	while (w) {
+		Waiter *next = w->next;
+		w->pool->ready_tasks(&w->task_id, 1);
+		w = next;
+	}
+
+	if (on_done)
+		on_done();
+
+	// Last, since a waiting thread may free the fence as soon as it sees this
+	signal.fetch_add(1);
+}
+
+void TaskGraphFence::rearm()
+{
+	if (signal.load(std::memory_order_acquire) == 0)
+		return;
+	failed = false;
+	waiters.store(nullptr, std::memory_order_relaxed);
+	signal.store(0, std::memory_order_release);
+}
+
+TaskGraphFence &TaskGraph::fence_after(TaskBase &t)
+{
+	task_fences.emplace_back();
+	task_fence_sources.push_back(&t);
+	return task_fences.back();
+}
+
+
+void TaskGraph::plan(detail::SubmitPlan &out)
+{
+	StackArena<4096> arena;
+	const unsigned none = ~0u;
+	unsigned n = (unsigned)tasks.size();
+
+	typedef std::pair<TaskBase *, unsigned> TaskIndex;
+
+	StackVector<TaskIndex> lookup(StackAllocator<TaskIndex>{arena});
+	lookup.reserve(n);
+	for (unsigned i = 0; i < n; ++i)
+		lookup.emplace_back(tasks[i], i);
+	std::sort(lookup.begin(), lookup.end());
+
+	auto index_of = [&](TaskBase *t) {
+		auto it = std::lower_bound(lookup.begin(), lookup.end(), TaskIndex(t, 0));
+		return it != lookup.end() && it->first == t ? it->second : none;
+	};
+
+	// A cancelled or failed run may have skipped anything, so the next one starts over
+	if (token->cancelled() || failure.raised.load()) {
+		submitted = false;
+		if (token == &cancellation)
+			cancellation.reset();
+	}
+	failure.reset();
+
+	// After the first run an incremental graph only schedules invalidated
+	// tasks and everything downstream of them; inputs left out keep the
+	// results of their last run and count as done
+	StackVector<bool> included(n, !incremental || !submitted, StackAllocator<bool>{arena});
+	if (incremental && submitted) {
+		StackVector<unsigned> dependents_first(n + 1, 0, StackAllocator<unsigned>{arena});
+		for (TaskBase *t : tasks)
+			for (unsigned j = 0; j < t->num_inputs; ++j) {
+				unsigned d = index_of(t->inputs[j]);
+				if (d != none)
+					++dependents_first[d + 1];
+			}
+		for (unsigned i = 0; i < n; ++i)
+			dependents_first[i + 1] += dependents_first[i];
+
+		StackVector<unsigned> dependents(dependents_first.back(), 0, StackAllocator<unsigned>{arena});
+		StackVector<unsigned> fill(dependents_first.begin(), dependents_first.end() - 1, StackAllocator<unsigned>{arena});
+		for (unsigned i = 0; i < n; ++i)
+			for (unsigned j = 0; j < tasks[i]->num_inputs; ++j) {
+				unsigned d = index_of(tasks[i]->inputs[j]);
+				if (d != none)
+					dependents[fill[d]++] = i;
+			}
+
+		StackVector<unsigned> work(StackAllocator<unsigned>{arena});
+		for (TaskBase *t : invalidated) {
+			unsigned d = index_of(t);
+			assert(d != none && "invalidated task is not part of the graph");
+			if (!included[d]) {
+				included[d] = true;
+				work.push_back(d);
+			}
+		}
+		while (!work.empty()) {
+			unsigned d = work.back();
+			work.pop_back();
+			for (unsigned k = dependents_first[d]; k < dependents_first[d + 1]; ++k) {
+				if (!included[dependents[k]]) {
+					included[dependents[k]] = true;
+					work.push_back(dependents[k]);
+				}
+			}
+		}
+	}
+	invalidated.clear();
+	submitted = true;
+
+	for (unsigned i = 0; i < n; ++i) {
+		tasks[i]->token = token;
+		tasks[i]->failure = &failure;
+		tasks[i]->completion = nullptr;
+		tasks[i]->budget = budget;
+		tasks[i]->hold = nullptr;
+	}
+
+	// Fences pass failures on to the graphs that depend on them
+	fence.failure = &failure;
+	for (unsigned k = 0; k < task_fences.size(); ++k) {
+		task_fences[k].rearm();
+		task_fences[k].failure = &failure;
+		task_fences[k].inputs = &task_fence_sources[k];
+		task_fences[k].num_inputs = 1;
+		task_fences[k].completion = nullptr;
+	}
+
+	// Inputs outside the graph must be fences of other graphs. Every distinct
+	// one gets a gate task, readied by the fence when it runs, which stands in
+	// for it as a dependency.
+	StackVector<TaskGraphFence *> external(upstream.begin(), upstream.end(), StackAllocator<TaskGraphFence *>{arena});
+	auto gate_of = [&](TaskGraphFence *f) {
+		unsigned k = 0;
+		while (k < external.size() && external[k] != f)
+			++k;
+		if (k == external.size())
+			external.push_back(f);
+		return k;
+	};
+
+	StackVector<unsigned> num_dependents(n, 0, StackAllocator<unsigned>{arena});
+	for (unsigned i = 0; i < n; ++i) {
 		TaskBase *t = tasks[i];
+		if (!included[i])
+			continue;
+		for (unsigned j = 0; j < t->num_inputs; ++j) {
+			unsigned d = index_of(t->inputs[j]);
+			if (d != none) {
+				++num_dependents[d];
+			} else {
+				TaskGraphFence *f = dynamic_cast<TaskGraphFence *>(t->inputs[j]);
+				assert(f && "dependency is neither part of the graph nor a fence");
+				gate_of(f);
+			}
+		}
+	}
 
-		if (t->num_inputs == 0) {
-			roots.push_back(ids[i]);
+	// Outputs with a memory cost stay held until their dependents here have run
+	holds.clear();
+	for (unsigned i = 0; i < n; ++i) {
+		if (!budget || !included[i] || !tasks[i]->memory)
 			continue;
+		holds.emplace_back();
+		MemoryHold &h = holds.back();
+		h.budget = budget;
+		h.bytes = tasks[i]->memory;
+		h.holders = num_dependents[i];
+		tasks[i]->hold = &h;
+	}
+
+	// A task with a fence_after() must end its chain so the fence fires early,
+	// and one with an extra outside dependency must start its own
+	for (TaskBase *t : task_fence_sources) {
+		unsigned d = index_of(t);
+		assert(d != none && "fence_after() task is not part of the graph");
+		if (included[d])
+			++num_dependents[d];
+	}
+
+	StackVector<bool> held(n, false, StackAllocator<bool>{arena});
+	for (auto &h : task_upstream) {
+		unsigned d = index_of(h.first);
+		assert(d != none && "depends_on() task is not part of the graph");
+		if (included[d]) {
+			held[d] = true;
+			gate_of(h.second);
 		}
+	}
 
-		std::vector<uint32_t> deps;
+	// Cheap tasks with all their inputs in this graph are not scheduled. The
+	// level of one counts the inline tasks it follows in turn; 0 means it is
+	// scheduled as usual.
+	StackVector<unsigned> level(n, 0, StackAllocator<unsigned>{arena});
+	for (unsigned i = 0; i < n; ++i) {
+		TaskBase *t = tasks[i];
+		if (!included[i] || held[i] || t->hold || !t->cost || t->cost >= inline_below || !max_inline_depth)
+			continue;
+		bool internal = false, external = false;
 		for (unsigned j = 0; j < t->num_inputs; ++j) {
-			TaskBase *dep  = t->inputs[j];
-			auto it = std::find(tasks.begin(), tasks.end(), dep);
-			unsigned dep_idx = std::distance(tasks.begin(), it);
-			uint32_t dep_id = ids[dep_idx];
-			deps.push_back(dep_id);
+			unsigned d = index_of(t->inputs[j]);
+			external = external || d == none;
+			internal = internal || (d != none && included[d]);
+		}
+		if (internal && !external)
+			level[i] = none;
+	}
+	for (bool changed = true; changed; ) {
+		changed = false;
+		for (unsigned i = 0; i < n; ++i) {
+			if (level[i] != none)
+				continue;
+			unsigned l = 1;
+			for (unsigned j = 0; j < tasks[i]->num_inputs && l; ++j) {
+				unsigned d = index_of(tasks[i]->inputs[j]);
+				if (!included[d])
+					continue;
+				if (level[d] == none)
+					l = 0;
+				else if (level[d] + 1 > l)
+					l = level[d] + 1;
+			}
+			if (l) {
+				level[i] = l <= max_inline_depth ? l : 0;
+				changed = true;
+			}
+		}
+	}
+	for (unsigned &l : level)
+		if (l == none)
+			l = 0; // on a cycle, which would never run either way
 
-			has_deps.insert(dep);
+	// Link every single-in/single-out edge; the links form chains that run
+	// as one scheduled unit
+	StackVector<unsigned> next(n, none, StackAllocator<unsigned>{arena});
+	StackVector<unsigned> prev(n, none, StackAllocator<unsigned>{arena});
+	for (unsigned i = 0; i < n; ++i) {
+		TaskBase *t = tasks[i];
+		if (!included[i] || level[i] || t->hold || t->num_inputs != 1 || !t->fuse || held[i])
+			continue;
+		unsigned p = index_of(t->inputs[0]);
+		if (p != none && included[p] && !level[p] && num_dependents[p] == 1 && tasks[p]->fuse) {
+			next[p] = i;
+			prev[i] = p;
 		}
+	}
+
+	StackVector<unsigned> heads(StackAllocator<unsigned>{arena});
+	StackVector<unsigned> unit_of(n, none, StackAllocator<unsigned>{arena});
+	heads.reserve(n);
+	for (unsigned i = 0; i < n; ++i) {
+		if (!included[i] || level[i] || prev[i] != none)
+			continue;
+		for (unsigned k = i; k != none; k = next[k])
+			unit_of[k] = (unsigned)heads.size();
+		heads.push_back(i);
+	}
+
+	// Units each inline task waits on, by level so that a unit arrives at
+	// the tasks an inline task follows before arriving at that one
+	StackVector<unsigned> by_level(StackAllocator<unsigned>{arena});
+	for (unsigned i = 0; i < n; ++i)
+		if (level[i])
+			by_level.push_back(i);
+	std::stable_sort(by_level.begin(), by_level.end(), [&](unsigned a, unsigned b) { return level[a] < level[b]; });
 
-		if (deps.size() > 0) {
-			pool.add_dependencies(&ids[i], 1, deps.data(), deps.size());
+	StackVector<unsigned> sources(StackAllocator<unsigned>{arena});
+	StackVector<unsigned> source_first(n, 0, StackAllocator<unsigned>{arena});
+	StackVector<unsigned> source_count(n, 0, StackAllocator<unsigned>{arena});
+	auto add_sources = [&](unsigned d) {
+		if (!level[d])
+			sources.push_back(unit_of[d]);
+		else
+			for (unsigned k = 0; k < source_count[d]; ++k)
+				sources.push_back(sources[source_first[d] + k]);
+	};
+
+	typedef std::pair<unsigned, InlineTask *> Follower;
+	StackVector<Follower> follow(StackAllocator<Follower>{arena});
+	inline_tasks.clear();
+	auto add_inline = [&](TaskBase *t, BikeShed_TaskFunc f, unsigned first) {
+		std::sort(sources.begin() + first, sources.end());
+		sources.erase(std::unique(sources.begin() + first, sources.end()), sources.end());
+		inline_tasks.emplace_back(t, f, (unsigned)sources.size() - first);
+		for (unsigned k = first; k < sources.size(); ++k)
+			follow.emplace_back(sources[k], &inline_tasks.back());
+	};
+
+	for (unsigned i : by_level) {
+		unsigned first = (unsigned)sources.size();
+		for (unsigned j = 0; j < tasks[i]->num_inputs; ++j) {
+			unsigned d = index_of(tasks[i]->inputs[j]);
+			if (included[d])
+				add_sources(d);
 		}
+		add_inline(tasks[i], funcs[i], first);
+		source_first[i] = first;
+		source_count[i] = (unsigned)sources.size() - first;
+	}
+
+	// Fences run after the task they follow, which has at least one source
+	for (unsigned k = 0; k < task_fences.size(); ++k) {
+		unsigned d = index_of(task_fence_sources[k]);
+		if (!included[d])
+			continue;
+		unsigned first = (unsigned)sources.size();
+		add_sources(d);
+		add_inline(&task_fences[k], &task_entry<TaskGraphFence>, first);
 	}
 
-	StackVector<uint32_t> leaves(StackAllocator<uint32_t>{arena});
-	leaves.reserve(has_deps.size());
-	for (unsigned i = 0; i < tasks.size(); ++i)
-		if (std::find(has_deps.begin(), has_deps.end(), tasks[i]) == has_deps.end())
-			leaves.push_back(ids[i]);
+	std::stable_sort(follow.begin(), follow.end(), [](const Follower &a, const Follower &b) { return a.first < b.first; });
+	followers.clear();
+	for (Follower &f : follow)
+		followers.push_back(f.second);
+
+	chains.clear();
+	chain_links.clear();
+	chain_funcs.clear();
+	chains.reserve(n);
+	chain_links.reserve(n);
+	chain_funcs.reserve(n);
 
-	uint32_t completion_id = ids.back();
-	pool.add_dependencies(&completion_id, 1, leaves.data(), leaves.size());
+	StackVector<TaskBase *> units(StackAllocator<TaskBase *>{arena});
+	StackVector<BikeShed_TaskFunc> unit_funcs(StackAllocator<BikeShed_TaskFunc>{arena});
+	units.reserve(heads.size());
+	unit_funcs.reserve(heads.size());
+
+	// A single task with followers becomes a chain of one
+	unsigned f = 0;
+	for (unsigned u = 0; u < heads.size(); ++u) {
+		unsigned i = heads[u];
+		unsigned first_follower = f;
+		while (f < follow.size() && follow[f].first == u)
+			++f;
+
+		if (next[i] == none && f == first_follower) {
+			units.push_back(tasks[i]);
+			unit_funcs.push_back(funcs[i]);
+		} else {
+			unsigned first = (unsigned)chain_links.size();
+			for (unsigned k = i; k != none; k = next[k]) {
+				chain_links.push_back(tasks[k]);
+				chain_funcs.push_back(funcs[k]);
+			}
+			chains.emplace_back(&chain_links[first], &chain_funcs[first], (unsigned)chain_links.size() - first,
+				f > first_follower ? &followers[first_follower] : nullptr, f - first_follower);
+			chains.back().token = token;
+			chains.back().affinity = tasks[i]->affinity;
+			units.push_back(&chains.back());
+			unit_funcs.push_back(&TaskChain::entry);
+		}
+	}
+
+	waiters.resize(external.size());
+	unsigned gate_base = (unsigned)out.units.size();
+	for (unsigned k = 0; k < external.size(); ++k) {
+		out.add_unit(nullptr, &gate_entry);
+		out.gates.push_back({ gate_base + k, external[k], &waiters[k] });
+	}
 
-	pool.ready_tasks(roots.data(), roots.size());
+	unsigned base = (unsigned)out.units.size();
+	for (unsigned u = 0; u < units.size(); ++u) {
+		TaskBase *t = tasks[heads[u]];
+		unsigned pu = out.add_unit(units[u], unit_funcs[u]);
+
+		bool internal = false;
+		for (unsigned j = 0; j < t->num_inputs; ++j) {
+			unsigned d = index_of(t->inputs[j]);
+			if (d != none && !included[d])
+				continue;
+			internal = internal || d != none;
+			if (d != none && level[d])
+				for (unsigned k = 0; k < source_count[d]; ++k)
+					out.add_dependency(base + sources[source_first[d] + k]);
+			else if (d != none)
+				out.add_dependency(base + unit_of[d]);
+			else
+				out.add_dependency(gate_base + gate_of(static_cast<TaskGraphFence *>(t->inputs[j])));
+		}
+		if (!internal)
+			for (TaskGraphFence *f : upstream)
+				out.add_dependency(gate_base + gate_of(f));
+		if (held[heads[u]])
+			for (auto &h : task_upstream)
+				if (h.first == t)
+					out.add_dependency(gate_base + gate_of(h.second));
+
+		if (out.dep_first[pu] == out.dep_first[pu + 1])
+			out.roots.push_back(pu);
+	}
+
+	// Fences of tasks left out of this run have nothing to follow
+	for (unsigned k = 0; k < task_fences.size(); ++k)
+		if (!included[index_of(task_fence_sources[k])])
+			out.roots.push_back(out.add_unit(&task_fences[k], &task_entry<TaskGraphFence>));
+}
+
+void TaskGraph::submit(ThreadPoolInterface &pool)
+{
+	StackArena<4096> arena;
+	detail::SubmitPlan p(arena);
+	plan(p);
+	p.add_fence(fence);
+	p.submit(pool, arena);
 }
 
 void TaskGraph::wait(ThreadPoolInterface &pool)
 {
-	while (fence.signal.load(std::memory_order_acquire) == 0)
+	while (poll() == WaitStatus::Timeout)
+		if (!pool.do_work())
+			pool.yield();
+}
+
+WaitStatus TaskGraph::poll()
+{
+	if (fence.signal.load(std::memory_order_acquire) == 0)
+		return WaitStatus::Timeout;
+
+	std::exception_ptr e = finish();
+	if (e)
+		std::rethrow_exception(e);
+	return WaitStatus::Ready;
+}
+
+std::exception_ptr TaskGraph::finish()
+{
+	if (token->cancelled() || failure.raised.load())
+		submitted = false;
+	return failure.error;
+}
+
+TaskGraphBatch::TaskGraphBatch(BatchFence mode) : graphs(), fence(), mode(mode)
+{
+}
+
+void TaskGraphBatch::add(TaskGraph &g)
+{
+	graphs.push_back(&g);
+}
+
+void TaskGraphBatch::submit(ThreadPoolInterface &pool)
+{
+	StackArena<4096> arena;
+	detail::SubmitPlan p(arena);
+	for (TaskGraph *g : graphs) {
+		g->plan(p);
+		if (mode == BatchFence::PerGraph)
+			p.add_fence(g->fence);
+	}
+	if (mode == BatchFence::Shared)
+		p.add_fence(fence);
+	p.submit(pool, arena);
+}
+
+void TaskGraphBatch::wait(ThreadPoolInterface &pool)
+{
+	if (mode == BatchFence::Shared) {
+		while (fence.signal.load(std::memory_order_acquire) == 0)
+			if (!pool.do_work())
+				pool.yield();
+	} else {
+		for (TaskGraph *g : graphs)
+			while (g->fence.signal.load(std::memory_order_acquire) == 0)
+				if (!pool.do_work())
+					pool.yield();
+	}
+
+	// Every graph has completed, so the first error can be rethrown safely
+	std::exception_ptr first;
+	for (TaskGraph *g : graphs) {
+		std::exception_ptr e = g->finish();
+		if (e && !first)
+			first = e;
+	}
+	if (first)
+		std::rethrow_exception(first);
+}
+
+PersistentTaskGraph::PersistentTaskGraph(TaskGraph &g, ThreadPoolInterface &pool) : pool(pool), graph(g)
+{
+	assert(!g.incremental && "incremental graphs cannot be persistent");
+
+	StackArena<4096> arena;
+	detail::SubmitPlan p(arena);
+	g.plan(p);
+	p.add_fence(g.fence);
+	assert(p.gates.empty() && g.upstream.empty() && "persistent graphs cannot depend on other graphs");
+
+	// The wrappers count the fence down instead, once they have readied their dependents
+	unsigned n = (unsigned)p.units.size();
+	for (unsigned u = 0; u < n; ++u) {
+		units.emplace_back(this, p.units[u], p.funcs[u]);
+		units[u].completion = &g.fence;
+		p.units[u]->completion = nullptr;
+	}
+
+	// Invert the input lists, which the units need to ready their dependents
+	for (unsigned u = 0; u < n; ++u) {
+		units[u].num_deps = p.dep_first[u + 1] - p.dep_first[u];
+		units[u].pending.store(units[u].num_deps, std::memory_order_relaxed);
+		for (unsigned j = p.dep_first[u]; j < p.dep_first[u + 1]; ++j)
+			++units[p.deps[j]].num_dependents;
+	}
+	unsigned first = 0;
+	for (Unit &unit : units) {
+		unit.first_dependent = first;
+		first += unit.num_dependents;
+		unit.num_dependents = 0;
+	}
+	dependents.resize(first);
+	for (unsigned u = 0; u < n; ++u) {
+		for (unsigned j = p.dep_first[u]; j < p.dep_first[u + 1]; ++j) {
+			Unit &d = units[p.deps[j]];
+			dependents[d.first_dependent + d.num_dependents++] = u;
+		}
+	}
+
+	StackVector<TaskBase *> contexts(StackAllocator<TaskBase *>{arena});
+	StackVector<BikeShed_TaskFunc> funcs(n, &Unit::entry, StackAllocator<BikeShed_TaskFunc>{arena});
+	for (Unit &unit : units)
+		contexts.push_back(&unit);
+	ids.resize(n);
+	if (n)
+		pool.add_tasks(contexts.data(), funcs.data(), n, ids.data());
+
+	for (unsigned u = 0; u < n; ++u)
+		if (units[u].num_deps == 0)
+			roots.push_back(ids[u]);
+}
+
+PersistentTaskGraph::~PersistentTaskGraph()
+{
+	// wait() has let every unit leave the pool, so none of the slots is in use
+	assert(!running && "persistent graph destroyed while running");
+	assert(inside.load() == 0);
+	if (!ids.empty())
+		pool.free_tasks(ids.data(), (unsigned)ids.size());
+}
+
+Bikeshed_TaskResult PersistentTaskGraph::Unit::entry(Bikeshed shed, Bikeshed_TaskID task_id, uint8_t channel, void *context)
+{
+	Unit &u = static_cast<Unit &>(*static_cast<TaskBase *>(context));
+	PersistentTaskGraph &g = *u.graph;
+
+	// Counted until the pool's execute() sees this return, which is when
+	// Bikeshed is done with the slot and it may be readied or freed again
+	g.inside.fetch_add(1, std::memory_order_relaxed);
+
+	// Every input has counted down already, so this is ready for the next run
+	u.pending.store(u.num_deps, std::memory_order_relaxed);
+	if (u.func(shed, task_id, channel, u.task) == BIKESHED_TASK_RESULT_BLOCKED) {
+		left_inside = &g.inside;
+		return BIKESHED_TASK_RESULT_BLOCKED; // held back by a memory budget
+	}
+
+	StackArena<4096> arena;
+	StackVector<uint32_t> ready(StackAllocator<uint32_t>{arena});
+	for (unsigned j = 0; j < u.num_dependents; ++j) {
+		unsigned d = g.dependents[u.first_dependent + j];
+		if (g.units[d].pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			ready.push_back(g.ids[d]);
+	}
+	if (!ready.empty())
+		g.pool.ready_tasks(ready.data(), (unsigned)ready.size());
+
+	// Kept alive for the next run. The fence may release wait() before this
+	// returns, but wait() also waits for inside, so the next submit() or the
+	// destructor only touches the slot once Bikeshed has let go of it
+	u.completion->task_done();
+	left_inside = &g.inside;
+	return BIKESHED_TASK_RESULT_BLOCKED;
+}
+
+void PersistentTaskGraph::submit()
+{
+	assert(!running && "wait() before submitting again");
+	running = true;
+
+	if (graph.token == &graph.cancellation)
+		graph.cancellation.reset();
+	graph.failure.reset();
+	graph.fence.rearm();
+	graph.fence.outstanding.store((unsigned)units.size(), std::memory_order_relaxed);
+	for (TaskGraphFence &f : graph.task_fences)
+		f.rearm();
+
+	if (roots.empty())
+		graph.fence();
+	else
+		pool.ready_tasks(roots.data(), (unsigned)roots.size());
+}
+
+void PersistentTaskGraph::wait()
+{
+	while (graph.fence.signal.load(std::memory_order_acquire) == 0 || inside.load(std::memory_order_acquire) != 0)
 		if (!pool.do_work())
 			pool.yield();
+	running = false;
+
+	if (graph.failure.error)
+		std::rethrow_exception(graph.failure.error);
 }
@@ -1,65 +1,573 @@
 #pragma once
 
+#include "stack_allocator.h"
+
+// Pads the ready heads and shed counters apart; the layout must match in
+// every translation unit, so it is set here rather than per file
+#if !defined(BIKESHED_L1CACHE_SIZE)
+#	define BIKESHED_L1CACHE_SIZE 64
+#endif
+#include "bikeshed.h"
+
 #include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <tuple>
 #include <vector>
 #include <type_traits>
+#include <typeinfo>
 #include <utility>
 
 struct TaskBase;
+struct TaskGraphFence;
+
+namespace detail
+{
+	struct SubmitPlan;
+} // detail
 
 struct ThreadPoolInterface
 {
 	virtual ~ThreadPoolInterface() = default;
-	virtual void add_tasks(TaskBase **tasks, unsigned num_tasks, uint32_t *out_task_ids) = 0;
+	virtual void add_tasks(TaskBase **tasks, BikeShed_TaskFunc *funcs, unsigned num_tasks, uint32_t *out_task_ids) = 0;
 	virtual void add_dependencies(uint32_t *tasks, unsigned num_tasks, uint32_t *dependencies, unsigned num_dependencies) = 0;
 	virtual void ready_tasks(uint32_t *tasks, unsigned num_tasks) = 0;
+	/** Releases tasks that were created but will not complete, such as those of a PersistentTaskGraph. */
+	virtual void free_tasks(uint32_t *tasks, unsigned num_tasks) = 0;
+	/** Runs a task if one is ready; implementations must do so through execute(). */
 	virtual bool do_work() = 0;
 	virtual void yield() = 0;
+
+	/**
+	 * Runs one ready task of shed on channel, then settles what the task left
+	 * for after its return, when Bikeshed is done with it: a task held back
+	 * by a MemoryBudget is deferred to be readied again through this pool,
+	 * and a PersistentTaskGraph learns that the unit may be readied again.
+	 */
+	bool execute(Bikeshed shed, uint8_t channel);
+
+	/** Temporary buffers for parallel algorithms. Pools may hand out a reused arena. */
+	virtual void *scratch_alloc(std::size_t bytes, std::size_t alignment) { return detail::fallback_alloc(bytes, alignment); }
+	virtual void scratch_free(void *p) { detail::fallback_free(p); }
+};
+
+/** Set to abandon a submitted graph; its queued tasks then complete without running. */
+struct CancellationToken
+{
+	std::atomic<bool> flag{false};
+
+	void cancel() { flag.store(true, std::memory_order_relaxed); }
+	void reset() { flag.store(false, std::memory_order_relaxed); }
+	bool cancelled() const { return flag.load(std::memory_order_relaxed); }
+};
+
+/** Keeps the first exception thrown by the tasks of a graph. */
+struct TaskFailure
+{
+	std::atomic<bool> raised{false};
+	std::exception_ptr error;
+
+	void capture(std::exception_ptr e)
+	{
+		bool expected = false;
+		if (e && raised.compare_exchange_strong(expected, true))
+			error = e;
+	}
+
+	void reset()
+	{
+		raised.store(false, std::memory_order_relaxed);
+		error = nullptr;
+	}
+};
+
+/**
+ * Caps the bytes held by the outputs of tasks that declare TaskBase::memory.
+ *
+ * A task is admitted when its output fits and deferred otherwise; it is
+ * readied again once enough has been released, which happens when the last
+ * dependent of an output has run. Deferred tasks whose inputs hold the most
+ * go first, since their dependents free memory soonest. When nothing that
+ * holds memory is running, the first deferred task is let through
+ * regardless, so a graph whose working set exceeds the budget still
+ * completes, only over budget.
+ */
+struct MemoryBudget
+{
+	struct Deferred
+	{
+		ThreadPoolInterface *pool; // readies it again
+		Bikeshed shed;
+		Bikeshed_TaskID task_id;
+		std::size_t bytes;
+		std::size_t frees; // held by its inputs
+	};
+
+	std::size_t limit;
+	std::atomic<unsigned> running{0}; // admitted tasks of budgeted graphs that have not finished
+
+	// Guarded by lock
+	std::mutex lock;
+	std::size_t in_use = 0;
+	std::size_t peak = 0;
+	Deferred forced{}; // let through over budget, not yet run
+	std::vector<Deferred> deferred;
+
+	explicit MemoryBudget(std::size_t limit) : limit(limit) {}
+
+	bool try_reserve(Bikeshed shed, Bikeshed_TaskID task_id, std::size_t bytes);
+
+	/** An admitted task has run; bytes is what it releases right away. */
+	void finished(std::size_t bytes);
+	void release(std::size_t bytes);
+
+	/** Queues a task that returned BIKESHED_TASK_RESULT_BLOCKED after failing try_reserve(); see ThreadPoolInterface::execute(). */
+	void defer(const Deferred &d);
+
+	// Readies deferred tasks that fit now; unlocks guard
+	void wake(std::unique_lock<std::mutex> &guard);
+};
+
+/** Bytes a task's output holds in a run, and the dependents yet to release it. */
+struct MemoryHold
+{
+	MemoryBudget *budget = nullptr;
+	std::size_t bytes = 0;
+	unsigned holders = 0;
+	std::atomic<unsigned> remaining{0};
 };
 
 struct TaskBase
 {
+	enum : unsigned { ANY_WORKER = ~0u };
+
 	TaskBase **inputs;
 	unsigned num_inputs;
-	TaskBase() : inputs(nullptr), num_inputs(0) {}
+	bool fuse; // may share a scheduled unit with a single-in/single-out neighbour
+	bool failed; // threw, or was skipped because an input failed
+	unsigned affinity; // worker, or group of workers sharing a channel, that should run this; see ThreadPool
+	unsigned cost; // rough run time in nanoseconds, 0 if unknown; see TaskGraph::inline_below
+	std::size_t memory; // bytes its output holds until its dependents have run; see MemoryBudget
+	const CancellationToken *token; // assigned by the graph on submit
+	TaskFailure *failure; // likewise
+	TaskGraphFence *completion; // counted down when this scheduled unit finishes
+	MemoryBudget *budget; // assigned by the graph on submit
+	MemoryHold *hold; // likewise, for tasks with memory
+	TaskBase() : inputs(nullptr), num_inputs(0), fuse(true), failed(false), affinity(ANY_WORKER), cost(0), memory(0), token(nullptr), failure(nullptr), completion(nullptr), budget(nullptr), hold(nullptr) {}
 	virtual ~TaskBase() = default;
 	virtual void operator()() = 0;
+
+	bool cancelled() const { return token && token->cancelled(); }
+
+	const TaskBase *failed_input() const
+	{
+		for (unsigned i = 0; i < num_inputs; ++i)
+			if (inputs[i]->failed)
+				return inputs[i];
+		return nullptr;
+	}
 };
 
+/**
+ * Completion marker of a graph. It is not scheduled itself: every unit of the
+ * graph counts it down as it finishes and the last one runs it. Tasks of
+ * other graphs may list a fence among their inputs; their graph then holds
+ * them back until the fence has run.
+ */
 struct TaskGraphFence : TaskBase
 {
+	/** A task in some pool that the fence readies when it runs. */
+	struct Waiter
+	{
+		Waiter *next;
+		ThreadPoolInterface *pool;
+		uint32_t task_id;
+	};
+
 	std::atomic<uint32_t> signal{0};
-	virtual void operator()() override { signal.fetch_add(1); }
+	std::atomic<Waiter *> waiters{nullptr};
+	std::atomic<unsigned> outstanding{0};
+
+	// Called by whichever thread finished the graph, before waiting threads
+	// are released; it must not wait on the graph itself
+	std::function<void()> on_done;
+
+	/** Queues w unless the fence has already run, in which case it returns false. */
+	bool add_waiter(Waiter *w);
+
+	/** Resets a fence that has run so that it can be submitted again. */
+	void rearm();
+
+	/** Readies the waiters; marked failed if its graph, or the task it follows, failed. */
+	virtual void operator()() override;
+
+	/** Called by each counted unit as it finishes; the last one runs the fence. */
+	void task_done()
+	{
+		if (outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			TaskGraphFence::operator()();
+	}
+};
+
+namespace detail
+{
+	template<typename T>
+	void run_task(T &t, std::false_type) { t.T::operator()(); }
+
+	template<typename T>
+	void run_task(T &t, std::true_type) { t(); }
+
+	/**
+	 * Runs t unless it was cancelled or an input failed. An exception is kept
+	 * in the graph's TaskFailure and marks t failed, so its dependents are
+	 * skipped in turn; a failure from another graph is passed on as well.
+	 */
+	template<typename T>
+	void execute(T &t)
+	{
+		t.failed = false;
+		if (t.cancelled())
+			return;
+		if (const TaskBase *in = t.failed_input()) {
+			t.failed = true;
+			if (t.failure && in->failure)
+				t.failure->capture(in->failure->error);
+			return;
+		}
+		try {
+			run_task(t, std::is_abstract<T>());
+		} catch (...) {
+			t.failed = true;
+			if (t.failure)
+				t.failure->capture(std::current_exception());
+		}
+	}
+
+	// Fences always run, or whatever waits on them would never be readied
+	inline void execute(TaskGraphFence &f) { f(); }
+
+	/** Reserves t's memory, or holds it back to be deferred once it returns. */
+	bool admit(TaskBase &t, Bikeshed shed, Bikeshed_TaskID task_id);
+
+	/** Releases t's memory if nothing depends on it, and that of inputs t was the last to use. */
+	void release_memory(TaskBase &t);
+} // detail
+
+/**
+ * Bikeshed entry point for tasks whose dynamic type is T. The call to
+ * T::operator() is qualified, so it binds statically and can be inlined;
+ * abstract types fall back to the virtual call.
+ */
+template<typename T>
+Bikeshed_TaskResult task_entry(Bikeshed shed, Bikeshed_TaskID task_id, uint8_t, void *context)
+{
+	T &t = static_cast<T &>(*static_cast<TaskBase *>(context));
+	if (t.budget && !detail::admit(t, shed, task_id))
+		return BIKESHED_TASK_RESULT_BLOCKED;
+	detail::execute(t);
+	if (t.budget)
+		detail::release_memory(t);
+	if (t.completion)
+		t.completion->task_done();
+	return BIKESHED_TASK_RESULT_COMPLETE;
+}
+
+/** task_entry<T> if T is the dynamic type of t, otherwise the virtual call. */
+template<typename T>
+BikeShed_TaskFunc task_entry_for(T &t)
+{
+	if (std::is_abstract<T>::value || typeid(t) != typeid(T))
+		return &task_entry<TaskBase>;
+	return &task_entry<T>;
+}
+
+/**
+ * A task too cheap to schedule. It follows the units its inputs run in, and
+ * the last of them to finish runs it inline before completing.
+ */
+struct InlineTask
+{
+	TaskBase *task;
+	BikeShed_TaskFunc func;
+	unsigned num_sources;
+	std::atomic<unsigned> pending;
+
+	InlineTask(TaskBase *t, BikeShed_TaskFunc f, unsigned n) : task(t), func(f), num_sources(n), pending(n) {}
+
+	/** Called by each source unit once it has run. */
+	void arrive(Bikeshed shed, Bikeshed_TaskID task_id, uint8_t channel)
+	{
+		if (pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+		// Every source has arrived, so this is ready for the next run
+		pending.store(num_sources, std::memory_order_relaxed);
+		func(shed, task_id, channel, task);
+	}
+};
+
+/** A run of tasks that submit() schedules as one unit, executed back to back, then its followers. */
+struct TaskChain : TaskBase
+{
+	TaskBase **links;
+	BikeShed_TaskFunc *funcs;
+	unsigned num_links;
+	InlineTask **followers;
+	unsigned num_followers;
+	TaskChain(TaskBase **l, BikeShed_TaskFunc *f, unsigned n, InlineTask **fl = nullptr, unsigned nf = 0)
+		: links(l), funcs(f), num_links(n), followers(fl), num_followers(nf) {}
+	virtual void operator()() override { assert(false && "chains run through TaskChain::entry"); }
+
+	static Bikeshed_TaskResult entry(Bikeshed shed, Bikeshed_TaskID task_id, uint8_t channel, void *context)
+	{
+		TaskChain &c = static_cast<TaskChain &>(*static_cast<TaskBase *>(context));
+		// Only the head can be held back by a memory budget, since tasks
+		// with memory are never linked after another
+		for (unsigned i = 0; i < c.num_links; ++i)
+			if (c.funcs[i](shed, task_id, channel, c.links[i]) == BIKESHED_TASK_RESULT_BLOCKED)
+				return BIKESHED_TASK_RESULT_BLOCKED;
+		for (unsigned i = 0; i < c.num_followers; ++i)
+			c.followers[i]->arrive(shed, task_id, channel);
+		if (c.completion)
+			c.completion->task_done();
+		return BIKESHED_TASK_RESULT_COMPLETE;
+	}
+};
+
+enum class WaitStatus
+{
+	Ready,   // completed; errors have been rethrown
+	Timeout, // still running
 };
 
 struct TaskGraph
 {
 	std::vector<TaskBase *> tasks;
+	std::vector<BikeShed_TaskFunc> funcs;
 	TaskGraphFence fence;
 
+	// Built by submit(), must stay alive until the graph completes
+	std::vector<TaskChain> chains;
+	std::vector<TaskBase *> chain_links;
+	std::vector<BikeShed_TaskFunc> chain_funcs;
+	std::deque<InlineTask> inline_tasks;
+	std::vector<InlineTask *> followers;
+	std::deque<MemoryHold> holds;
+	std::vector<TaskGraphFence::Waiter> waiters;
+
+	// Dependencies on, and fences for, other graphs
+	std::vector<TaskGraphFence *> upstream;
+	std::vector<std::pair<TaskBase *, TaskGraphFence *>> task_upstream;
+	std::deque<TaskGraphFence> task_fences;
+	std::vector<TaskBase *> task_fence_sources;
+
+	// When set, a resubmitted graph only runs invalidated tasks and their
+	// dependents; the rest keep the results of their previous run
+	bool incremental = false;
+	bool submitted = false;
+	std::vector<TaskBase *> invalidated;
+
+	// Tasks with a cost hint below inline_below nanoseconds, and every
+	// fence_after() fence, run inline on the worker that finishes their
+	// last input instead of being scheduled. Cheap tasks following other
+	// inline ones nest up to max_inline_depth, beyond which one is
+	// scheduled again, so no worker is left with a long serial tail.
+	unsigned inline_below = 1000;
+	unsigned max_inline_depth = 4;
+
+	// Admits the tasks with a memory cost; may be shared by several graphs.
+	// Such tasks are neither fused after another nor run inline.
+	MemoryBudget *budget = nullptr;
+
+	// Checked by every task before it runs; may point at a token shared by
+	// several graphs
+	CancellationToken cancellation;
+	CancellationToken *token = &cancellation;
+
+	// First exception thrown by a task of the current run
+	TaskFailure failure;
+
 	template<typename... Tasks>
 	TaskGraph(Tasks&... t) : tasks() , fence()
 	{
-		tasks.reserve((unsigned)sizeof...(Tasks));
-		int dummy[] = {0, (tasks.push_back(static_cast<TaskBase *>(&t)), 0)...};
+		reserve((unsigned)sizeof...(Tasks));
+		int dummy[] = {0, (add(t), 0)...};
 		(void)dummy;
 	}
 
-	TaskGraph(const std::vector<TaskBase *> &ts) : tasks(ts), fence() { }
+	/** Tasks given by base pointer are dispatched through the vtable. */
+	TaskGraph(const std::vector<TaskBase *> &ts) : tasks(ts), funcs(ts.size(), &task_entry<TaskBase>), fence() { }
+	TaskGraph(std::vector<TaskBase *> &ts) : tasks(ts), funcs(ts.size(), &task_entry<TaskBase>), fence() { }
 
 	template<typename T>
 	TaskGraph(std::vector<T> &ts) : tasks(), fence()
 	{
-		tasks.reserve(ts.size());
+		reserve(ts.size());
 		for (auto &t : ts)
-			tasks.push_back(static_cast<TaskBase *>(&t));
+			add(t);
+	}
+
+	/** Adds t, dispatched straight to T::operator() when T is its dynamic type and through the vtable otherwise. */
+	template<typename T>
+	void add(T &t)
+	{
+		tasks.push_back(static_cast<TaskBase *>(&t));
+		funcs.push_back(task_entry_for(t));
 	}
 
+	void reserve(std::size_t n)
+	{
+		tasks.reserve(n);
+		funcs.reserve(n);
+	}
+
+	/** Holds back the roots of this graph until f has run. */
+	void depends_on(TaskGraphFence &f) { upstream.push_back(&f); }
+	void depends_on(TaskGraph &g) { depends_on(g.fence); }
+
+	/** Holds back t until f has run, on top of t's own inputs. */
+	void depends_on(TaskBase &t, TaskGraphFence &f) { task_upstream.emplace_back(&t, &f); }
+
+	/**
+	 * Fence that runs as soon as t has, so that other graphs can start on t's
+	 * output before this whole graph completes. Call before submit().
+	 */
+	TaskGraphFence &fence_after(TaskBase &t);
+
+	/** Marks t to run again, along with everything downstream of it, on the next incremental submit(). */
+	void invalidate(TaskBase &t) { invalidated.push_back(&t); }
+
+	/**
+	 * Queued tasks complete without running from here on, and slices can poll
+	 * Slice::cancelled(); the fence still fires, so wait() returns promptly.
+	 * The graph's own token is cleared on the next submit.
+	 */
+	void cancel() { token->cancel(); }
+
+	/**
+	 * Resubmitting is allowed once wait() has returned. If a task threw,
+	 * wait() rethrows the first exception after the graph has completed;
+	 * tasks downstream of a failed one are skipped.
+	 */
+	void submit(ThreadPoolInterface &pool);
+	void wait(ThreadPoolInterface &pool);
+
+	/** Whether the graph has completed, without blocking; rethrows like wait(). */
+	WaitStatus poll();
+
+	/**
+	 * Like wait(), helping the pool until the graph completes, but gives up at
+	 * the deadline. A task the caller picks up runs to the end, so the
+	 * deadline can be overshot by one task. After a timeout the graph keeps
+	 * running and must stay alive; wait or poll again later.
+	 */
+	template<typename Clock, typename Duration>
+	WaitStatus wait_until(ThreadPoolInterface &pool, const std::chrono::time_point<Clock, Duration> &deadline)
+	{
+		while (poll() == WaitStatus::Timeout) {
+			if (Clock::now() >= deadline)
+				return WaitStatus::Timeout;
+			if (!pool.do_work())
+				pool.yield();
+		}
+		return WaitStatus::Ready;
+	}
+
+	template<typename Rep, typename Period>
+	WaitStatus wait_for(ThreadPoolInterface &pool, const std::chrono::duration<Rep, Period> &timeout)
+	{
+		return wait_until(pool, std::chrono::steady_clock::now() + timeout);
+	}
+
+	/** Bookkeeping once the fence has run; returns the first exception of the run, if any. */
+	std::exception_ptr finish();
+
+	/** Appends the graph's scheduled units to out; used by submit() and TaskGraphBatch. */
+	void plan(detail::SubmitPlan &out);
+};
+
+enum class BatchFence
+{
+	PerGraph, // every graph signals its own fence and can be waited on alone
+	Shared,   // one fence behind all graphs; wait on the batch
+};
+
+/**
+ * Submits several graphs as one pool transaction: a single add_tasks call for
+ * all of them, one dependency pass and a single ready_tasks call. The graphs
+ * must stay alive until the batch completes.
+ */
+struct TaskGraphBatch
+{
+	std::vector<TaskGraph *> graphs;
+	TaskGraphFence fence;
+	BatchFence mode;
+
+	TaskGraphBatch(BatchFence mode = BatchFence::PerGraph);
+
+	void add(TaskGraph &g);
 	void submit(ThreadPoolInterface &pool);
+
+	/** Waits for every graph, then rethrows the first exception of any of them. */
 	void wait(ThreadPoolInterface &pool);
 };
 
+/**
+ * Runs a TaskGraph of fixed shape over and over without creating pool tasks
+ * for every run. The graph is planned and its tasks are created once; they
+ * stay alive between runs and readiness is tracked here instead of by the
+ * pool. Each unit restores its own counter of pending inputs when it runs,
+ * so submit() only resets the fences and readies the roots.
+ *
+ * The TaskGraph must outlive this and may not be submitted on its own in the
+ * meantime. Incremental graphs and dependencies on other graphs are not
+ * supported; fence_after() fences are.
+ */
+struct PersistentTaskGraph
+{
+	struct Unit : TaskBase
+	{
+		PersistentTaskGraph *graph;
+		TaskBase *task;
+		BikeShed_TaskFunc func;
+		unsigned first_dependent;
+		unsigned num_dependents;
+		unsigned num_deps;
+		std::atomic<unsigned> pending;
+
+		Unit(PersistentTaskGraph *g, TaskBase *t, BikeShed_TaskFunc f)
+			: graph(g), task(t), func(f), first_dependent(0), num_dependents(0), num_deps(0), pending(0)
+		{
+			affinity = t->affinity;
+		}
+
+		virtual void operator()() override { func(nullptr, 0, 0, task); }
+
+		static Bikeshed_TaskResult entry(Bikeshed shed, Bikeshed_TaskID task_id, uint8_t channel, void *context);
+	};
+
+	ThreadPoolInterface &pool;
+	TaskGraph &graph;
+	std::deque<Unit> units;
+	std::vector<unsigned> dependents;
+	std::vector<uint32_t> ids;
+	std::vector<uint32_t> roots;
+	bool running = false;
+	std::atomic<unsigned> inside{0}; // units that have not yet left Bikeshed_ExecuteOne
+
+	PersistentTaskGraph(TaskGraph &g, ThreadPoolInterface &pool);
+	~PersistentTaskGraph();
+
+	void submit();
+	void wait();
+};
+
 // Task function object interface
 
 template<typename... Deps>
@@ -88,6 +596,122 @@ struct Task<> : TaskBase
 	Task() {}
 };
 
+// Typed task interface
+
+/**
+ * Output port of a typed task. Each run publishes a fresh value, which the
+ * consumers share by reference count; the last of them to pick it up clears
+ * the port, so the value is freed as soon as every consumer is done with
+ * it. A port without consumers keeps the value for the caller.
+ */
+template<typename T>
+struct TaskOutput : TaskBase
+{
+	std::shared_ptr<T> value;
+	unsigned num_consumers = 0;
+	std::atomic<unsigned> unclaimed{0};
+
+	void publish(T &&v)
+	{
+		value = std::make_shared<T>(std::move(v));
+		unclaimed.store(num_consumers, std::memory_order_relaxed);
+	}
+
+	/** Called once per run by each consumer. */
+	std::shared_ptr<T> claim()
+	{
+		assert(value && "typed output claimed twice; an incremental consumer needs its producers rerun too");
+		// Copied before counting down, so the last consumer cannot clear it under us
+		std::shared_ptr<T> v = value;
+		if (unclaimed.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			value.reset();
+		return v;
+	}
+
+	T &result()
+	{
+		assert(value && "no result; the task has not run, or its consumers took it");
+		return *value;
+	}
+};
+
+namespace detail
+{
+	template<typename Out>
+	struct TypedTaskBase { typedef TaskOutput<Out> type; };
+
+	template<>
+	struct TypedTaskBase<void> { typedef TaskBase type; };
+
+	template<typename T>
+	T take_input(std::shared_ptr<T> &in, std::true_type)
+	{
+		if (in.use_count() == 1)
+			return std::move(*in);
+		return *in;
+	}
+
+	template<typename T>
+	T take_input(std::shared_ptr<T> &in, std::false_type)
+	{
+		assert(in.use_count() == 1 && "a move-only output can only have one consumer");
+		return std::move(*in);
+	}
+} // detail
+
+/**
+ * Value of a typed input: moved out when no other consumer holds it, which
+ * is always the case for a single consumer, and copied otherwise.
+ */
+template<typename T>
+T take_input(std::shared_ptr<T> &in)
+{
+	return detail::take_input(in, std::is_copy_constructible<T>());
+}
+
+/**
+ * Task that computes an Out from the outputs of tasks producing In...
+ * Results are handed over rather than read out of the producer, so a large
+ * intermediate lives only until its last consumer has run. Implement run(),
+ * which may keep or move from its inputs, see take_input(). Task<void(In...)>
+ * has no output.
+ */
+template<typename Out, typename... In>
+struct Task<Out(In...)> : detail::TypedTaskBase<Out>::type
+{
+	enum { NUM_DEPS = sizeof...(In) > 0 ? sizeof...(In) : 1 };
+	TaskBase *storage[NUM_DEPS];
+	std::tuple<TaskOutput<In>&...> in;
+
+	Task(TaskOutput<In>&... producers) : in(producers...)
+	{
+		unsigned i = 0;
+		int dummy[] = {0, (storage[i++] = &producers, ++producers.num_consumers, 0)...};
+		(void)dummy;
+		this->inputs = storage;
+		this->num_inputs = sizeof...(In);
+	}
+
+	virtual Out run(std::shared_ptr<In>... in) = 0;
+
+	virtual void operator()() override
+	{
+		call(std::is_void<Out>(), std::index_sequence_for<In...>());
+	}
+
+	template<std::size_t... I>
+	void call(std::false_type, std::index_sequence<I...>)
+	{
+		this->publish(run(std::get<I>(in).claim()...));
+	}
+
+	template<std::size_t... I>
+	void call(std::true_type, std::index_sequence<I...>)
+	{
+		run(std::get<I>(in).claim()...);
+	}
+};
+
 // Task function interface
 
 template<typename F, typename... Deps>
@@ -138,12 +762,28 @@ inline unsigned chunk_size(unsigned count, const SliceSettings &s)
 	return size;
 }
 
-inline unsigned num_chunks(unsigned count, const SliceSettings &s)
+/**
+ * Elements by which data sits past the previous alignment boundary, where the
+ * boundary is alignment * sizeof(T) bytes. Chunk offsets are shifted back by
+ * this amount so that every chunk after the first starts on a boundary; the
+ * first chunk absorbs the misaligned head instead.
+ */
+template<typename T>
+inline unsigned chunk_skew(const T *data, const SliceSettings &s)
+{
+	std::size_t bytes = s.alignment * sizeof(T);
+	std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(data);
+	if (s.alignment <= 1 || (bytes & (bytes - 1)) || addr % sizeof(T))
+		return 0;
+	return (unsigned)((addr & (bytes - 1)) / sizeof(T));
+}
+
+inline unsigned num_chunks(unsigned count, const SliceSettings &s, unsigned skew = 0)
 {
 	if (count == 0)
 		return 0;
 	unsigned cs = chunk_size(count, s);
-	return (count + cs - 1) / cs;
+	return (count + skew + cs - 1) / cs;
 }
 
 template<typename T, typename R>
@@ -152,6 +792,10 @@ struct Slice
 	T *data;
 	R &result;
 	unsigned count;
+	const CancellationToken *token;
+
+	/** Cheap enough to poll between blocks of a long slice. */
+	bool cancelled() const { return token && token->cancelled(); }
 };
 
 template<typename T, typename R, typename F>
@@ -166,7 +810,7 @@ struct TaskSlice : TaskBase
 		: func(std::move(f)), data(d), count(c) {}
 
 	virtual void operator()() override {
-		func(Slice<T, R>{data, result, count});
+		func(Slice<T, R>{data, result, count, token});
 	}
 };
 
@@ -176,13 +820,15 @@ auto slice(unsigned count, T *data, F &&f, SliceSettings s = {})
 {
 	using Task = TaskSlice<T, R, typename std::decay<F>::type>;
 	std::vector<Task> tasks;
-	unsigned n = num_chunks(count, s);
+	unsigned skew = chunk_skew(data, s);
+	unsigned n = num_chunks(count, s, skew);
+	unsigned cs = chunk_size(count, s);
 	tasks.reserve(n);
 	for (unsigned i = 0; i < n; ++i) {
-		unsigned cs = chunk_size(count, s);
-		unsigned off = cs * i;
-		unsigned len = (off + cs > count) ? count - off : cs;
-		tasks.emplace_back(std::forward<F>(f), data + off, len);
+		unsigned off = i ? cs * i - skew : 0;
+		unsigned end = cs * (i + 1) - skew;
+		unsigned len = (end > count ? count : end) - off;
+		tasks.emplace_back(f, data + off, len);
 	}
 	return tasks;
 }
@@ -0,0 +1,84 @@
+#include "task_pipeline.h"
+
+#include <cassert>
+#include <exception>
+#include <utility>
+
+namespace
+{
+	// Frees the frame even if its graph failed, so a slot is never stuck
+	std::exception_ptr retire(ThreadPoolInterface &pool, std::unique_ptr<PipelineFrame> &slot)
+	{
+		std::exception_ptr e;
+		try {
+			slot->graph.wait(pool);
+		} catch (...) {
+			e = std::current_exception();
+		}
+		slot.reset();
+		return e;
+	}
+} // anonymous
+
+FramePipeline::FramePipeline(ThreadPoolInterface &pool, unsigned max_in_flight, Factory factory)
+	: pool(pool), factory(std::move(factory)), slots(max_in_flight ? max_in_flight : 1), next_frame(0)
+{
+}
+
+FramePipeline::~FramePipeline()
+{
+	// Errors are only reported by an explicit drain()
+	try {
+		drain();
+	} catch (...) {
+	}
+}
+
+void FramePipeline::push()
+{
+	std::unique_ptr<PipelineFrame> &slot = slots[next_frame % slots.size()];
+	std::exception_ptr failed = slot ? retire(pool, slot) : nullptr;
+
+	std::unique_ptr<PipelineFrame> frame = factory(next_frame);
+	assert(frame && "pipeline factory returned no frame");
+	frame->index = next_frame;
+
+	// With a single slot the previous frame has just been freed
+	PipelineFrame *prev = next_frame ? slots[(next_frame - 1) % slots.size()].get() : nullptr;
+	if (prev) {
+		for (unsigned k = 0; k < frame->stages.size() && k < prev->stage_fences.size(); ++k)
+			frame->graph.depends_on(*frame->stages[k], *prev->stage_fences[k]);
+	}
+
+	frame->stage_fences.clear();
+	for (TaskBase *t : frame->stages)
+		frame->stage_fences.push_back(&frame->graph.fence_after(*t));
+
+	frame->graph.submit(pool);
+	slot = std::move(frame);
+	++next_frame;
+
+	if (failed)
+		std::rethrow_exception(failed);
+}
+
+void FramePipeline::run(uint64_t num_frames)
+{
+	for (uint64_t i = 0; i < num_frames; ++i)
+		push();
+}
+
+void FramePipeline::drain()
+{
+	std::exception_ptr first;
+	for (uint64_t i = 0; i < slots.size() && i < next_frame; ++i) {
+		std::unique_ptr<PipelineFrame> &slot = slots[(next_frame - 1 - i) % slots.size()];
+		if (slot) {
+			std::exception_ptr e = retire(pool, slot);
+			if (e && !first)
+				first = e;
+		}
+	}
+	if (first)
+		std::rethrow_exception(first);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "task_graph.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/**
+ * One frame of a FramePipeline. Derive from it to own the frame's tasks, add
+ * them to graph and register the stages in pipeline order with stage().
+ */
+struct PipelineFrame
+{
+	uint64_t index = 0;
+	TaskGraph graph;
+	std::vector<TaskBase *> stages;
+	std::vector<TaskGraphFence *> stage_fences;
+
+	virtual ~PipelineFrame() = default;
+
+	void stage(TaskBase &t) { stages.push_back(&t); }
+};
+
+/**
+ * Runs a graph per frame with up to max_in_flight frames in the pool at once.
+ *
+ * Stage k of frame N waits for stage k of frame N-1 but nothing else of it, so
+ * consecutive frames overlap stage by stage and throughput is bound by the
+ * slowest stage rather than by the whole frame. A frame is freed before the
+ * frame max_in_flight after it is built, which bounds memory.
+ */
+struct FramePipeline
+{
+	typedef std::function<std::unique_ptr<PipelineFrame>(uint64_t index)> Factory;
+
+	ThreadPoolInterface &pool;
+	Factory factory;
+	std::vector<std::unique_ptr<PipelineFrame>> slots;
+	uint64_t next_frame;
+
+	FramePipeline(ThreadPoolInterface &pool, unsigned max_in_flight, Factory factory);
+	~FramePipeline();
+
+	/**
+	 * Builds and submits the next frame, first waiting for the frame whose
+	 * slot it reuses. If that frame failed, its error is rethrown once the
+	 * new frame is on its way.
+	 */
+	void push();
+	void run(uint64_t num_frames);
+
+	/** Waits for and frees every frame in flight, then rethrows the first error among them. */
+	void drain();
+};
@@ -0,0 +1,426 @@
+#pragma once
+
+#include "task_graph.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ * Streaming dataflow on top of the pool.
+ *
+ * A Stream is a linear chain of nodes: one source, any number of stages and
+ * one sink, each connected to the next by a bounded queue. Nodes are not
+ * long lived threads; whenever a node has input and room downstream, up to
+ * `parallelism` worker tasks are spawned into the pool and drain it until it
+ * runs dry or is throttled. A producer must reserve a slot in the queue it
+ * pushes into before taking an item, so a slow stage stalls its producers
+ * instead of letting queues grow, and memory stays at the queue capacities.
+ */
+
+/** Bounded lock-free multi-producer multi-consumer ring (Vyukov). */
+template<typename T>
+struct MpmcQueue
+{
+	struct Cell
+	{
+		std::atomic<std::size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	std::size_t mask;
+
+	// Producers and consumers each get a cache line to themselves
+	char pad0[64];
+	std::atomic<std::size_t> enqueue_pos;
+	char pad1[64];
+	std::atomic<std::size_t> dequeue_pos;
+	char pad2[64];
+
+	explicit MpmcQueue(std::size_t capacity) : enqueue_pos(0), dequeue_pos(0)
+	{
+		std::size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		cells.reset(new Cell[size]);
+		for (std::size_t i = 0; i < size; ++i)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		mask = size - 1;
+	}
+
+	std::size_t capacity() const { return mask + 1; }
+
+	bool empty() const
+	{
+		return enqueue_pos.load() == dequeue_pos.load();
+	}
+
+	bool try_push(T &&v)
+	{
+		std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell &c = cells[pos & mask];
+			std::size_t seq = c.sequence.load(std::memory_order_acquire);
+			std::intptr_t diff = (std::intptr_t)seq - (std::intptr_t)pos;
+			if (diff == 0) {
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1)) {
+					c.value = std::move(v);
+					c.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(T &v)
+	{
+		std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell &c = cells[pos & mask];
+			std::size_t seq = c.sequence.load(std::memory_order_acquire);
+			std::intptr_t diff = (std::intptr_t)seq - (std::intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1)) {
+					v = std::move(c.value);
+					c.sequence.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+};
+
+struct Stream;
+
+/** Common part of stream nodes: worker accounting and spawning. */
+struct StreamNode : TaskBase
+{
+	Stream &stream;
+	StreamNode *prev;
+	unsigned parallelism;
+	std::atomic<unsigned> active{0};
+	BikeShed_TaskFunc entry;
+
+	StreamNode(Stream &s, StreamNode *p, unsigned n, BikeShed_TaskFunc e)
+		: stream(s), prev(p), parallelism(n ? n : 1), entry(e) {}
+
+	/** Moves one item along. Returns false when starved or throttled. */
+	virtual bool step() = 0;
+
+	/** Whether step() could make progress right now. */
+	virtual bool runnable() = 0;
+
+	/**
+	 * Takes a worker slot. Queue positions, credits and active are all
+	 * sequentially consistent, so either a producer sees a retiring worker's
+	 * slot as free or that worker's last runnable() check sees the new item.
+	 */
+	bool try_activate()
+	{
+		unsigned a = active.load();
+		while (a < parallelism)
+			if (active.compare_exchange_weak(a, a + 1))
+				return true;
+		return false;
+	}
+
+	/** Gives up the worker slot; returns true if it was taken again because work arrived meanwhile. */
+	inline bool retire();
+
+	inline void kick();
+
+	// Workers run through detail::stream_entry, never as plain tasks
+	virtual void operator()() override { assert(false && "stream nodes are run by stream_entry"); }
+};
+
+/** Receiving end of a node: its input queue and the slots producers may still reserve. */
+template<typename T>
+struct StreamInput : StreamNode
+{
+	MpmcQueue<T> queue;
+	std::atomic<int> credits;
+
+	StreamInput(Stream &s, StreamNode *p, unsigned n, BikeShed_TaskFunc e, std::size_t capacity)
+		: StreamNode(s, p, n, e), queue(capacity), credits((int)queue.capacity()) {}
+
+	bool reserve()
+	{
+		int c = credits.load();
+		while (c > 0)
+			if (credits.compare_exchange_weak(c, c - 1))
+				return true;
+		return false;
+	}
+
+	/** Returns a slot; true if the producer may have been throttled on it. */
+	bool unreserve()
+	{
+		return credits.fetch_add(1) == 0;
+	}
+
+	/**
+	 * Pushes into a slot taken with reserve(). The ring cell it lands in may
+	 * still be finishing a pop on another thread, which is only ever brief.
+	 */
+	void push(T &&v);
+
+	/** Pops an item and hands its slot back to the producer. */
+	bool pop(T &v)
+	{
+		if (!queue.try_pop(v))
+			return false;
+		if (unreserve())
+			prev->kick();
+		return true;
+	}
+};
+
+template<typename T>
+struct StreamOutput
+{
+	StreamInput<T> *next = nullptr;
+};
+
+struct Stream
+{
+	ThreadPoolInterface &pool;
+	std::vector<std::unique_ptr<StreamNode>> nodes;
+
+	std::atomic<uint64_t> in_flight{0};
+	std::atomic<bool> source_done{false};
+	std::atomic<bool> finished{false};
+	std::atomic<unsigned> workers{0};
+	TaskFailure failure; // first exception thrown by a callback; stops the stream
+
+	Stream(ThreadPoolInterface &p) : pool(p) {}
+
+	~Stream()
+	{
+		assert(workers.load() == 0 && "stream destroyed while running");
+	}
+
+	template<typename T, typename G>
+	StreamOutput<T> &source(G gen);
+
+	template<typename In, typename Out, typename F>
+	StreamOutput<Out> &stage(StreamOutput<In> &from, F func, unsigned parallelism = 1, std::size_t capacity = 256);
+
+	template<typename In, typename F>
+	void sink(StreamOutput<In> &from, F func, unsigned parallelism = 1, std::size_t capacity = 256);
+
+	void run()
+	{
+		assert(nodes.size() >= 2 && "a stream needs a source and a sink");
+		nodes[0]->kick();
+	}
+
+	bool failed() const { return failure.raised.load(std::memory_order_acquire); }
+
+	/**
+	 * Helps the pool until the source is exhausted, every item has left the
+	 * sink and all workers are gone. If a callback threw, waits only for the
+	 * workers, which stop early, and rethrows the exception like TaskGraph::wait().
+	 */
+	void wait()
+	{
+		while ((!finished.load() && !failed()) || workers.load() != 0)
+			if (!pool.do_work())
+				pool.yield();
+		if (failure.error)
+			std::rethrow_exception(failure.error);
+	}
+
+	void item_started() { in_flight.fetch_add(1); }
+
+	void item_done()
+	{
+		if (in_flight.fetch_sub(1) == 1 && source_done.load())
+			finished.store(true);
+	}
+
+	void source_exhausted()
+	{
+		source_done.store(true);
+		if (in_flight.load() == 0)
+			finished.store(true);
+	}
+};
+
+namespace detail
+{
+	/** Worker task of a stream node; step() binds statically like task_entry. */
+	template<typename Node>
+	Bikeshed_TaskResult stream_entry(Bikeshed, Bikeshed_TaskID, uint8_t, void *context)
+	{
+		Node &n = static_cast<Node &>(*static_cast<TaskBase *>(context));
+		Stream &s = n.stream;
+		try {
+			do {
+				while (!s.failed() && n.Node::step())
+					;
+			} while (n.retire());
+		} catch (...) {
+			// The item in hand is lost, so the stream cannot finish; wait()
+			// only waits for the workers to drain and then rethrows
+			s.failure.capture(std::current_exception());
+			n.active.fetch_sub(1);
+		}
+		s.workers.fetch_sub(1);
+		return BIKESHED_TASK_RESULT_COMPLETE;
+	}
+} // detail
+
+template<typename T>
+void StreamInput<T>::push(T &&v)
+{
+	while (!queue.try_push(std::move(v)))
+		stream.pool.yield();
+	kick();
+}
+
+inline bool StreamNode::retire()
+{
+	active.fetch_sub(1);
+	return !stream.failed() && runnable() && try_activate();
+}
+
+inline void StreamNode::kick()
+{
+	if (stream.failed() || active.load() >= parallelism || !runnable() || !try_activate())
+		return;
+	stream.workers.fetch_add(1);
+	TaskBase *self = this;
+	uint32_t id;
+	stream.pool.add_tasks(&self, &entry, 1, &id);
+	stream.pool.ready_tasks(&id, 1);
+}
+
+/** Produces items from gen(T &), which returns false once the stream has ended. Runs one worker. */
+template<typename T, typename G>
+struct StreamSource : StreamNode, StreamOutput<T>
+{
+	G gen;
+
+	StreamSource(Stream &s, G g)
+		: StreamNode(s, nullptr, 1, &detail::stream_entry<StreamSource>), gen(std::move(g)) {}
+
+	virtual bool step() override
+	{
+		if (stream.source_done.load() || !this->next->reserve())
+			return false;
+		T v;
+		if (!gen(v)) {
+			this->next->unreserve();
+			stream.source_exhausted();
+			return false;
+		}
+		stream.item_started();
+		this->next->push(std::move(v));
+		return true;
+	}
+
+	virtual bool runnable() override
+	{
+		return !stream.source_done.load() && this->next->credits.load() > 0;
+	}
+};
+
+/** Maps items with func(In &, Out &); items for which it returns false are dropped. */
+template<typename In, typename Out, typename F>
+struct StreamStage : StreamInput<In>, StreamOutput<Out>
+{
+	F func;
+
+	StreamStage(Stream &s, StreamNode *p, F f, unsigned n, std::size_t capacity)
+		: StreamInput<In>(s, p, n, &detail::stream_entry<StreamStage>, capacity), func(std::move(f)) {}
+
+	virtual bool step() override
+	{
+		if (!this->next->reserve())
+			return false;
+		In in;
+		if (!this->pop(in)) {
+			this->next->unreserve();
+			return false;
+		}
+		Out out;
+		if (func(in, out)) {
+			this->next->push(std::move(out));
+		} else {
+			this->next->unreserve();
+			this->stream.item_done();
+		}
+		return true;
+	}
+
+	virtual bool runnable() override
+	{
+		return !this->queue.empty() && this->next->credits.load() > 0;
+	}
+};
+
+/** Consumes items with func(In &). */
+template<typename In, typename F>
+struct StreamSink : StreamInput<In>
+{
+	F func;
+
+	StreamSink(Stream &s, StreamNode *p, F f, unsigned n, std::size_t capacity)
+		: StreamInput<In>(s, p, n, &detail::stream_entry<StreamSink>, capacity), func(std::move(f)) {}
+
+	virtual bool step() override
+	{
+		In in;
+		if (!this->pop(in))
+			return false;
+		func(in);
+		this->stream.item_done();
+		return true;
+	}
+
+	virtual bool runnable() override
+	{
+		return !this->queue.empty();
+	}
+};
+
+template<typename T, typename G>
+StreamOutput<T> &Stream::source(G gen)
+{
+	assert(nodes.empty() && "the source must come first");
+	StreamSource<T, G> *n = new StreamSource<T, G>(*this, std::move(gen));
+	nodes.emplace_back(n);
+	return *n;
+}
+
+template<typename In, typename Out, typename F>
+StreamOutput<Out> &Stream::stage(StreamOutput<In> &from, F func, unsigned parallelism, std::size_t capacity)
+{
+	assert(!nodes.empty() && &from == dynamic_cast<StreamOutput<In> *>(nodes.back().get()) && "stages must be chained in order");
+	StreamStage<In, Out, F> *n = new StreamStage<In, Out, F>(*this, nodes.back().get(), std::move(func), parallelism, capacity);
+	from.next = n;
+	nodes.emplace_back(n);
+	return *n;
+}
+
+template<typename In, typename F>
+void Stream::sink(StreamOutput<In> &from, F func, unsigned parallelism, std::size_t capacity)
+{
+	assert(!nodes.empty() && &from == dynamic_cast<StreamOutput<In> *>(nodes.back().get()) && "stages must be chained in order");
+	StreamSink<In, F> *n = new StreamSink<In, F>(*this, nodes.back().get(), std::move(func), parallelism, capacity);
+	from.next = n;
+	nodes.emplace_back(n);
+}
@@ -0,0 +1,440 @@
+#define BIKESHED_IMPLEMENTATION
+#include "thread_pool.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdio.h>
+#include <assert.h>
+
+#if defined(DEBUG) || defined(_DEBUG)
+#	define DEBUG_PRINTF(fmt, ...) \
+		do { \
+			fprintf(stderr, "[%lu] " fmt "\n", GetCurrentThreadId(), ## __VA_ARGS__); \
+			fflush(stderr); \
+		} while (0);
+#else
+#	define DEBUG_PRINTF(fmt, ...)
+#endif
+
+namespace
+{
+
+// The pool or WorkerSet the calling thread works for and the channel it
+// polls first; under locality also the pool and channel of the task it
+// readied for itself
+thread_local const void *worker_of = nullptr;
+thread_local unsigned home_channel = ~0u;
+thread_local ThreadPool *kept_pool = nullptr;
+thread_local uint8_t kept_channel = 0;
+
+DWORD WINAPI worker_entry(LPVOID param)
+{
+	ThreadPool *pool = (ThreadPool *)param;
+	worker_of = pool;
+	home_channel = pool->next_home.fetch_add(1, std::memory_order_relaxed);
+	DEBUG_PRINTF("thread start");
+	while (true) {
+		WaitForSingleObject(pool->semaphore, INFINITE);
+		DEBUG_PRINTF("thread woke");
+		if (pool->quit.load(std::memory_order_acquire))
+			break;
+		while (pool->do_work())
+			;
+	}
+	DEBUG_PRINTF("thread exit");
+	return 0;
+}
+
+DWORD WINAPI elastic_worker_entry(LPVOID param)
+{
+	ThreadPool *pool = (ThreadPool *)param;
+	worker_of = pool;
+	home_channel = pool->next_home.fetch_add(1, std::memory_order_relaxed);
+	DEBUG_PRINTF("elastic thread start");
+	while (true) {
+		DWORD woke = WaitForSingleObject(pool->semaphore, pool->idle_ms);
+		if (pool->quit.load(std::memory_order_acquire))
+			break;
+		if (woke == WAIT_TIMEOUT) {
+			unsigned n = pool->live.load();
+			if (n > pool->min_threads && pool->live.compare_exchange_strong(n, n - 1)) {
+				// A task readied while this timed out may have counted it as
+				// live and not grown; hand that task to a fresh worker
+				if (pool->backlog.load() > 0)
+					pool->grow();
+				DEBUG_PRINTF("elastic thread retired");
+				return 0;
+			}
+			continue;
+		}
+		while (pool->do_work())
+			;
+	}
+	DEBUG_PRINTF("elastic thread exit");
+	pool->live.fetch_sub(1);
+	return 0;
+}
+
+DWORD WINAPI shared_worker_entry(LPVOID param)
+{
+	WorkerSet *set = (WorkerSet *)param;
+	worker_of = set;
+	home_channel = set->next_home.fetch_add(1, std::memory_order_relaxed);
+	DEBUG_PRINTF("shared thread start");
+	while (true) {
+		WaitForSingleObject(set->semaphore, INFINITE);
+		if (set->quit.load(std::memory_order_acquire))
+			break;
+		while (set->run_one())
+			;
+	}
+	DEBUG_PRINTF("shared thread exit");
+	return 0;
+}
+
+void bikeshed_assert(const char *expression, const char* file, int line)
+{
+	fprintf(stderr, "Assertion failed: %s\n", expression);
+	fprintf(stderr, "At: %s:%d\n", file, line);
+	fflush(stderr);
+	assert(false);
+}
+
+void bikeshed_signal_ready(struct Bikeshed_ReadyCallback* ready_callback, uint8_t channel, uint32_t ready_count)
+{
+	DEBUG_PRINTF("bikeshed_signal_ready ready_count=%u", ready_count);
+	ThreadPool *self = (ThreadPool *)ready_callback;
+
+	// A worker only readies tasks from inside one and keeps calling do_work()
+	// afterwards, so it can take the first of them without a wakeup
+	uint32_t wake = ready_count;
+	bool own = worker_of == self || (self->workers && worker_of == self->workers);
+	if (self->locality && own && kept_pool != self) {
+		kept_pool = self;
+		kept_channel = channel;
+		--wake;
+	}
+	if (wake)
+		ReleaseSemaphore(self->workers ? self->workers->semaphore : self->semaphore, wake, NULL);
+	if (self->max_threads) {
+		// Ordered before grow() reads live, against a retiring worker
+		// that drops live before it reads the backlog
+		self->backlog.fetch_add((int)ready_count);
+		self->grow();
+	}
+}
+
+} // anonymous
+
+WorkerSet::WorkerSet()
+{
+	semaphore = CreateSemaphoreW(NULL, 0, 0x7fffffff, NULL);
+	assert(semaphore);
+}
+
+WorkerSet::~WorkerSet()
+{
+	shutdown();
+	CloseHandle(semaphore);
+}
+
+void WorkerSet::start(unsigned num_threads)
+{
+	threads.resize(num_threads);
+	for (unsigned i = 0; i < num_threads; ++i) {
+		threads[i] = CreateThread(NULL, 0, shared_worker_entry, this, 0, NULL);
+		assert(threads[i]);
+	}
+}
+
+void WorkerSet::shutdown()
+{
+	if (threads.empty())
+		return;
+
+	quit.store(true, std::memory_order_release);
+	ReleaseSemaphore(semaphore, (LONG)threads.size(), NULL);
+	WaitForMultipleObjects((DWORD)threads.size(), threads.data(), TRUE, INFINITE);
+
+	for (HANDLE h : threads)
+		CloseHandle(h);
+
+	threads.clear();
+}
+
+unsigned WorkerSet::join(ThreadPool &pool, unsigned weight, unsigned max_workers)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	unsigned n = num_members.load(std::memory_order_relaxed);
+	unsigned k = 0;
+	while (k < n && members[k].pool.load() != nullptr)
+		++k;
+	assert(k < MAX_POOLS && "too many pools in a WorkerSet");
+
+	// Start level with the least served member so past service is not owed
+	uint64_t pass = UINT64_MAX;
+	for (unsigned i = 0; i < n; ++i)
+		if (i != k && members[i].pool.load() != nullptr && members[i].pass.load() < pass)
+			pass = members[i].pass.load();
+
+	Member &m = members[k];
+	m.stride = (uint64_t(1) << 20) / (weight ? weight : 1);
+	m.cap = max_workers ? max_workers : ~0u;
+	m.pass.store(pass == UINT64_MAX ? 0 : pass);
+	m.pool.store(&pool);
+	if (k == n)
+		num_members.store(n + 1, std::memory_order_release);
+	return k;
+}
+
+void WorkerSet::leave(unsigned member)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	Member &m = members[member];
+	m.pool.store(nullptr);
+	while (m.active.load() != 0)
+		YieldProcessor();
+}
+
+bool WorkerSet::run_one()
+{
+	unsigned n = num_members.load(std::memory_order_acquire);
+	unsigned order[MAX_POOLS];
+	uint64_t passes[MAX_POOLS];
+	for (unsigned i = 0; i < n; ++i) {
+		passes[i] = members[i].pass.load(std::memory_order_relaxed);
+		unsigned j = i;
+		for (; j > 0 && passes[order[j - 1]] > passes[i]; --j)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	for (unsigned j = 0; j < n; ++j) {
+		Member &m = members[order[j]];
+
+		// Taking the slot first means leave() never waits on a worker that is
+		// about to enter
+		if (m.active.fetch_add(1) >= m.cap) {
+			m.active.fetch_sub(1);
+			continue;
+		}
+		ThreadPool *pool = m.pool.load();
+		bool ran = pool && pool->do_work();
+		m.active.fetch_sub(1);
+		if (!ran)
+			continue;
+
+		uint64_t pass = m.pass.fetch_add(m.stride, std::memory_order_relaxed);
+
+		// Pools ahead in line had nothing to run and forfeit their lead
+		for (unsigned i = 0; i < j; ++i) {
+			std::atomic<uint64_t> &p = members[order[i]].pass;
+			uint64_t old = p.load(std::memory_order_relaxed);
+			while (old < pass && !p.compare_exchange_weak(old, pass, std::memory_order_relaxed))
+				;
+		}
+		return true;
+	}
+	return false;
+}
+
+ThreadPool::ThreadPool()
+	: shed(nullptr), channels(1), locality(false), workers(nullptr), member(0), min_threads(0), max_threads(0), idle_ms(0), scratch(nullptr), scratch_size(0)
+{
+	SignalReady = &bikeshed_signal_ready;
+	Bikeshed_SetAssert(bikeshed_assert);
+	semaphore = CreateSemaphoreW(NULL, 0, 0x7fffffff, NULL);
+	assert(semaphore);
+}
+
+ThreadPool::~ThreadPool()
+{
+	shutdown();
+	CloseHandle(semaphore);
+	if (scratch)
+		detail::fallback_free(scratch);
+}
+
+void ThreadPool::start(unsigned num_threads)
+{
+	threads.resize(num_threads);
+	for (unsigned i = 0; i < num_threads; ++i) {
+		threads[i] = CreateThread(NULL, 0, worker_entry, this, 0, NULL);
+		assert(threads[i]);
+	}
+}
+
+void ThreadPool::start_elastic(unsigned min, unsigned max, unsigned idle)
+{
+	assert(threads.empty() && !workers && !max_threads && "pool already has workers");
+	assert(max > 0 && min <= max);
+	min_threads = min;
+	max_threads = max;
+	idle_ms = idle;
+	for (unsigned i = 0; i < min; ++i) {
+		live.fetch_add(1);
+		HANDLE h = CreateThread(NULL, 0, elastic_worker_entry, this, 0, NULL);
+		assert(h);
+		CloseHandle(h);
+	}
+}
+
+void ThreadPool::grow()
+{
+	// A few queued tasks per live worker before adding one, so short
+	// blips are absorbed by the workers there are
+	const int depth_per_worker = 4;
+	unsigned n = live.load();
+	while (n < max_threads && backlog.load(std::memory_order_relaxed) > (int)n * depth_per_worker) {
+		if (live.compare_exchange_weak(n, n + 1)) {
+			HANDLE h = CreateThread(NULL, 0, elastic_worker_entry, this, 0, NULL);
+			assert(h);
+			CloseHandle(h);
+			DEBUG_PRINTF("elastic thread added, %u live", n + 1);
+			return;
+		}
+	}
+}
+
+void ThreadPool::join(WorkerSet &set, unsigned weight, unsigned max_workers)
+{
+	assert(threads.empty() && !workers && "pool already has workers");
+	member = set.join(*this, weight, max_workers);
+	workers = &set;
+
+	// Tasks readied before joining have only signalled the pool's own semaphore
+	ReleaseSemaphore(set.semaphore, (LONG)set.threads.size(), NULL);
+}
+
+void ThreadPool::shutdown()
+{
+	if (workers) {
+		workers->leave(member);
+		workers = nullptr;
+	}
+	if (max_threads) {
+		// Elastic workers are detached; each wakes, sees quit and checks out
+		quit.store(true, std::memory_order_release);
+		ReleaseSemaphore(semaphore, (LONG)max_threads, NULL);
+		while (live.load() != 0)
+			SwitchToThread();
+		max_threads = 0;
+		return;
+	}
+	if (threads.empty())
+		return;
+
+	quit.store(true, std::memory_order_release);
+	ReleaseSemaphore(semaphore, (LONG)threads.size(), NULL);
+	WaitForMultipleObjects((DWORD)threads.size(), threads.data(), TRUE, INFINITE);
+
+	for (HANDLE h : threads)
+		CloseHandle(h);
+
+	threads.clear();
+}
+
+void ThreadPool::add_tasks(TaskBase **tasks, BikeShed_TaskFunc *funcs, unsigned num_tasks, uint32_t *out_task_ids)
+{
+	int ok = Bikeshed_CreateTasks(shed, num_tasks, funcs, reinterpret_cast<void **>(tasks), out_task_ids);
+	assert(ok);
+	if (channels < 2)
+		return;
+
+	// Contiguous runs per channel, so readying them stays a few pushes
+	unsigned run = (num_tasks + channels - 1) / channels;
+	unsigned channel = next_channel.fetch_add(1, std::memory_order_relaxed);
+	for (unsigned first = 0; first < num_tasks; first += run, ++channel) {
+		unsigned n = num_tasks - first < run ? num_tasks - first : run;
+		Bikeshed_SetTasksChannel(shed, n, out_task_ids + first, (uint8_t)(channel % channels));
+	}
+
+	// Tasks with an affinity go to its channel instead
+	auto affinity_of = [&](unsigned i) { return tasks[i] ? tasks[i]->affinity : (unsigned)TaskBase::ANY_WORKER; };
+	for (unsigned first = 0, last; first < num_tasks; first = last) {
+		unsigned affinity = affinity_of(first);
+		for (last = first + 1; last < num_tasks && affinity_of(last) == affinity; ++last)
+			;
+		if (affinity != TaskBase::ANY_WORKER)
+			Bikeshed_SetTasksChannel(shed, last - first, out_task_ids + first, (uint8_t)(affinity % channels));
+	}
+}
+
+void ThreadPool::add_dependencies(uint32_t *tasks, unsigned num_tasks, uint32_t *dependencies, unsigned num_dependencies)
+{
+	int ok = Bikeshed_AddDependencies(shed, num_tasks, tasks, num_dependencies, dependencies);
+	assert(ok);
+}
+
+void ThreadPool::ready_tasks(uint32_t *tasks, unsigned num_tasks)
+{
+	Bikeshed_ReadyTasks(shed, num_tasks, tasks);
+}
+
+void ThreadPool::free_tasks(uint32_t *tasks, unsigned num_tasks)
+{
+	Bikeshed_FreeTasks(shed, num_tasks, tasks);
+}
+
+bool ThreadPool::do_work()
+{
+	if (!execute_one())
+		return false;
+	if (max_threads)
+		backlog.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool ThreadPool::execute_one()
+{
+	// Each thread starts at the head it readied a task into for itself, or
+	// else at its own, and moves on to the others when it is empty, so
+	// threads mostly contend with one another only when work runs low
+	unsigned first = 0;
+	if (kept_pool == this) {
+		kept_pool = nullptr;
+		first = kept_channel;
+	} else if (channels > 1) {
+		// Threads that are not workers take homes of their own
+		static std::atomic<unsigned> threads_seen{0};
+		if (home_channel == ~0u)
+			home_channel = threads_seen.fetch_add(1, std::memory_order_relaxed);
+		first = home_channel;
+	}
+	bool ran = false;
+	for (unsigned i = 0; i < channels && !ran; ++i)
+		ran = execute(shed, (uint8_t)((first + i) % channels));
+	return ran;
+}
+
+void ThreadPool::yield()
+{
+	YieldProcessor();
+}
+
+void *ThreadPool::scratch_alloc(std::size_t bytes, std::size_t alignment)
+{
+	const std::size_t scratch_alignment = 64;
+	if (alignment > scratch_alignment || scratch_busy.exchange(true, std::memory_order_acquire))
+		return detail::fallback_alloc(bytes, alignment);
+
+	if (scratch_size < bytes) {
+		if (scratch)
+			detail::fallback_free(scratch);
+		scratch = detail::fallback_alloc(bytes, scratch_alignment);
+		scratch_size = scratch ? bytes : 0;
+	}
+	if (!scratch)
+		scratch_busy.store(false, std::memory_order_release);
+	return scratch;
+}
+
+void ThreadPool::scratch_free(void *p)
+{
+	if (p && p == scratch)
+		scratch_busy.store(false, std::memory_order_release);
+	else
+		detail::fallback_free(p);
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "task_graph.h"
+#include "bikeshed.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+struct ThreadPool;
+
+/**
+ * Worker threads shared by several ThreadPools.
+ *
+ * Pools that join() a set start no threads of their own. Each worker runs
+ * one task at a time from the pool that has received the least service
+ * relative to its weight (stride scheduling), skipping pools that are at
+ * their cap on concurrent workers. A pool that had nothing to run when
+ * another one did gives up its unused share, so an idle subsystem cannot
+ * bank time and later crowd out the others.
+ */
+struct WorkerSet
+{
+	enum { MAX_POOLS = 16 };
+
+	struct Member
+	{
+		std::atomic<ThreadPool *> pool{nullptr};
+		std::atomic<uint64_t> pass{0};
+		std::atomic<unsigned> active{0};
+		uint64_t stride = 0;
+		unsigned cap = 0;
+	};
+
+	void *semaphore;
+	std::vector<void *> threads;
+	std::atomic<bool> quit{false};
+	std::atomic<unsigned> next_home{0};
+
+	std::mutex lock; // serializes join and leave
+	Member members[MAX_POOLS];
+	std::atomic<unsigned> num_members{0};
+
+	WorkerSet();
+	~WorkerSet();
+
+	void start(unsigned num_threads);
+	void shutdown();
+
+	/** Adds pool with a share proportional to weight and at most max_workers threads in it at once (0 for all). */
+	unsigned join(ThreadPool &pool, unsigned weight, unsigned max_workers);
+
+	/** Removes a member once no worker is inside it. */
+	void leave(unsigned member);
+
+	/** Runs one task from the most underserved pool; false if none had work. */
+	bool run_one();
+};
+
+/**
+ * Bikeshed backed worker pool.
+ *
+ * The caller owns the shed memory and assigns `shed` before start(); worker
+ * threads sleep on a semaphore that is released once per readied task. A
+ * shed created with several channels can be sharded by setting `channels`
+ * to match: tasks are spread over the channels' ready heads and each thread
+ * prefers its own, which eases contention on a single head. Worker k of
+ * start() polls channel k % channels first, and a task whose affinity is k
+ * is placed there; others still take it when they run out of work. With
+ * fewer channels than workers, a channel stands for the group of workers
+ * sharing it, such as the threads of one node.
+ *
+ * With `locality` set, a worker that readies tasks while running one keeps
+ * the first of them for itself rather than waking another thread, and polls
+ * the channel it went to next, so a dependent usually runs where its input
+ * is still in cache.
+ *
+ * Instead of starting its own threads a pool can join() a WorkerSet, or
+ * start_elastic() to let its worker count follow the load.
+ */
+struct ThreadPool : public Bikeshed_ReadyCallback, public ThreadPoolInterface
+{
+	Bikeshed shed;
+	unsigned channels;
+	bool locality;
+	std::atomic<unsigned> next_channel{0};
+	std::atomic<unsigned> next_home{0};
+	void *semaphore;
+
+	std::vector<void *> threads;
+	std::atomic<bool> quit{false};
+
+	// Set while the pool is served by shared workers
+	WorkerSet *workers;
+	unsigned member;
+
+	// Elastic mode, see start_elastic(); max_threads is 0 otherwise
+	unsigned min_threads;
+	unsigned max_threads;
+	unsigned idle_ms;
+	std::atomic<unsigned> live{0};
+	std::atomic<int> backlog{0}; // readied tasks not yet picked up
+
+	// Single scratch block reused across scratch_alloc calls, grown on demand
+	void *scratch;
+	std::size_t scratch_size;
+	std::atomic<bool> scratch_busy{false};
+
+	ThreadPool();
+	~ThreadPool();
+
+	void start(unsigned num_threads);
+	void shutdown();
+
+	/**
+	 * Keeps between min and max worker threads. A worker is added when the
+	 * tasks waiting exceed a few per live worker and retires after idle_ms
+	 * without work, so bursts get the full width and idle periods cost no
+	 * wakeups. The thresholds differ on purpose, so the count does not
+	 * flap around a steady load.
+	 */
+	void start_elastic(unsigned min, unsigned max, unsigned idle_ms = 1000);
+
+	/** Worker threads alive right now; only differs from num_threads() when elastic. */
+	unsigned concurrency() const
+	{
+		return max_threads ? live.load(std::memory_order_relaxed) : num_threads();
+	}
+
+	/** Adds a worker if the backlog calls for one. */
+	void grow();
+
+	/** Uses the threads of set rather than its own; see WorkerSet::join(). */
+	void join(WorkerSet &set, unsigned weight = 1, unsigned max_workers = 0);
+
+	unsigned num_threads() const
+	{
+		if (max_threads)
+			return max_threads;
+		if (!workers)
+			return (unsigned)threads.size();
+		unsigned n = (unsigned)workers->threads.size();
+		unsigned cap = workers->members[member].cap;
+		return cap < n ? cap : n;
+	}
+
+	virtual void add_tasks(TaskBase **tasks, BikeShed_TaskFunc *funcs, unsigned num_tasks, uint32_t *out_task_ids) override;
+	virtual void add_dependencies(uint32_t *tasks, unsigned num_tasks, uint32_t *dependencies, unsigned num_dependencies) override;
+	virtual void ready_tasks(uint32_t *tasks, unsigned num_tasks) override;
+	virtual void free_tasks(uint32_t *tasks, unsigned num_tasks) override;
+	virtual bool do_work() override;
+	bool execute_one();
+	virtual void yield() override;
+	virtual void *scratch_alloc(std::size_t bytes, std::size_t alignment) override;
+	virtual void scratch_free(void *p) override;
+};